@@ -0,0 +1,195 @@
+
+#include <string.h>
+
+#include <Rversion.h>
+
+#include "processx.h"
+
+/* Lines of the captured output, as an ALTREP character vector.
+
+   `data1` is a list of the UTF-8 buffer (a raw vector) and the line
+   offsets (an integer vector). The offsets have one extra element: line
+   `i` starts at `offsets[i]`, and its newline is at `offsets[i+1] - 1`.
+   If the output does not end with a newline, then the last offset points
+   one after the end of the buffer, as if there was a newline there.
+   The buffer is exactly as long as the output.
+
+   `data2` is NULL, until the whole vector is needed, e.g. for DATAPTR
+   or for changing it. Then it is a regular character vector, and the
+   buffer is released. Single elements are created on access, and they
+   are not kept, R's CHARSXP cache does that for us. */
+
+#if defined(R_VERSION) && R_VERSION >= R_Version(3, 5, 0)
+
+#include <R_ext/Altrep.h>
+
+static R_altrep_class_t processx__lines_class;
+
+#define PROCESSX__LINES_BUF(x)     VECTOR_ELT(R_altrep_data1(x), 0)
+#define PROCESSX__LINES_OFFSETS(x) VECTOR_ELT(R_altrep_data1(x), 1)
+
+static SEXP processx__lines_elt_from(SEXP buf, SEXP offsets, R_xlen_t i) {
+  const char *ptr = (const char*) RAW(buf);
+  int *off = INTEGER(offsets);
+  int start = off[i], len = off[i + 1] - 1 - start;
+  /* \r before \n is dropped, but not at the end of the output */
+  if (len > 0 && off[i + 1] <= XLENGTH(buf) &&
+      ptr[start + len - 1] == '\r') {
+    len--;
+  }
+  return mkCharLenCE(ptr + start, len, CE_UTF8);
+}
+
+static SEXP processx__lines_materialize(SEXP x) {
+  SEXP result = R_altrep_data2(x);
+  if (result == R_NilValue) {
+    SEXP buf = PROTECT(PROCESSX__LINES_BUF(x));
+    SEXP offsets = PROTECT(PROCESSX__LINES_OFFSETS(x));
+    R_xlen_t i, n = XLENGTH(offsets) - 1;
+    result = PROTECT(allocVector(STRSXP, n));
+    for (i = 0; i < n; i++) {
+      SET_STRING_ELT(result, i, processx__lines_elt_from(buf, offsets, i));
+    }
+    R_set_altrep_data2(x, result);
+    R_set_altrep_data1(x, R_NilValue);
+    UNPROTECT(3);
+  }
+  return result;
+}
+
+static R_xlen_t processx__lines_length(SEXP x) {
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue) return XLENGTH(data2);
+  return XLENGTH(PROCESSX__LINES_OFFSETS(x)) - 1;
+}
+
+static Rboolean processx__lines_inspect(SEXP x, int pre, int deep,
+					int pvec,
+					void (*inspect_subtree)(SEXP, int,
+								int, int)) {
+  Rprintf("processx lines (len=%d, materialized=%s)\n",
+	  (int) processx__lines_length(x),
+	  R_altrep_data2(x) != R_NilValue ? "T" : "F");
+  return TRUE;
+}
+
+static SEXP processx__lines_serialized_state(SEXP x) {
+  return processx__lines_materialize(x);
+}
+
+static SEXP processx__lines_unserialize(SEXP class, SEXP state) {
+  return state;
+}
+
+static void *processx__lines_dataptr(SEXP x, Rboolean writeable) {
+  return DATAPTR(processx__lines_materialize(x));
+}
+
+static const void *processx__lines_dataptr_or_null(SEXP x) {
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 == R_NilValue) return NULL;
+  return DATAPTR(data2);
+}
+
+static SEXP processx__lines_elt(SEXP x, R_xlen_t i) {
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue) return STRING_ELT(data2, i);
+  return processx__lines_elt_from(PROCESSX__LINES_BUF(x),
+				  PROCESSX__LINES_OFFSETS(x), i);
+}
+
+static void processx__lines_set_elt(SEXP x, R_xlen_t i, SEXP v) {
+  SET_STRING_ELT(processx__lines_materialize(x), i, v);
+}
+
+static int processx__lines_no_na(SEXP x) {
+  return R_altrep_data2(x) == R_NilValue;
+}
+
+void processx__init_altrep(DllInfo *dll) {
+  processx__lines_class =
+    R_make_altstring_class("processx_lines", "processx", dll);
+
+  R_set_altrep_Length_method(processx__lines_class, processx__lines_length);
+  R_set_altrep_Inspect_method(processx__lines_class,
+			      processx__lines_inspect);
+  R_set_altrep_Serialized_state_method(processx__lines_class,
+				       processx__lines_serialized_state);
+  R_set_altrep_Unserialize_method(processx__lines_class,
+				  processx__lines_unserialize);
+
+  R_set_altvec_Dataptr_method(processx__lines_class,
+			      processx__lines_dataptr);
+  R_set_altvec_Dataptr_or_null_method(processx__lines_class,
+				      processx__lines_dataptr_or_null);
+
+  R_set_altstring_Elt_method(processx__lines_class, processx__lines_elt);
+  R_set_altstring_Set_elt_method(processx__lines_class,
+				 processx__lines_set_elt);
+  R_set_altstring_No_NA_method(processx__lines_class,
+			       processx__lines_no_na);
+}
+
+/* `buf` holds `size` bytes of UTF-8 text, `size` is at most INT_MAX */
+
+SEXP processx__lines_new(SEXP buf, size_t size) {
+  const char *ptr = (const char*) RAW(buf), *end = ptr + size, *eol;
+  size_t nlines = 0;
+  int *off;
+  SEXP offsets, data1, result;
+
+  for (eol = ptr; (eol = memchr(eol, '\n', end - eol)); eol++) nlines++;
+  if (size > 0 && end[-1] != '\n') nlines++;
+
+  offsets = PROTECT(allocVector(INTSXP, nlines + 1));
+  off = INTEGER(offsets);
+  off[0] = 0;
+  for (nlines = 0, eol = ptr; (eol = memchr(eol, '\n', end - eol)); eol++) {
+    off[++nlines] = (int) (eol - ptr) + 1;
+  }
+  if (size > 0 && end[-1] != '\n') off[++nlines] = (int) size + 1;
+
+  /* The buffer is usually larger than the output. We shrink it, which
+     also means that the buffer ends where the output ends. */
+  if ((size_t) XLENGTH(buf) != size) buf = lengthgets(buf, size);
+  PROTECT(buf);
+  data1 = PROTECT(allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(data1, 0, buf);
+  SET_VECTOR_ELT(data1, 1, offsets);
+
+  result = R_new_altrep(processx__lines_class, data1, R_NilValue);
+
+  UNPROTECT(3);
+  return result;
+}
+
+#else
+
+void processx__init_altrep(DllInfo *dll) { }
+
+/* No ALTREP, create all elements now */
+
+SEXP processx__lines_new(SEXP buf, size_t size) {
+  const char *ptr = (const char*) RAW(buf), *end = ptr + size, *eol;
+  size_t nlines = 0;
+  SEXP result;
+
+  for (eol = ptr; (eol = memchr(eol, '\n', end - eol)); eol++) nlines++;
+  if (size > 0 && end[-1] != '\n') nlines++;
+
+  result = PROTECT(allocVector(STRSXP, nlines));
+  for (nlines = 0; ptr < end; nlines++) {
+    size_t len;
+    eol = memchr(ptr, '\n', end - ptr);
+    if (!eol) eol = end;
+    len = eol - ptr;
+    if (len > 0 && eol < end && ptr[len - 1] == '\r') len--;
+    SET_STRING_ELT(result, nlines, mkCharLenCE(ptr, len, CE_UTF8));
+    ptr = eol + 1;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+#endif
@@ -0,0 +1,101 @@
+
+#include "processx.h"
+
+/* Benchmark driver
+ *
+ * The timing sensitive parts of the benchmarks in `R/bench.R` are here,
+ * so that they do not measure the R interpreter. All times are seconds,
+ * from a monotonic clock, see `processx__now()`. On Linux and Windows
+ * this clock is the same for all processes, so `px clock` output can be
+ * compared to it.
+ */
+
+SEXP processx_bench_clock() {
+  return ScalarReal(processx__now());
+}
+
+/* Read a connection until EOF, as fast as we can. Returns the number of
+   bytes and newlines, and the elapsed time. */
+
+SEXP processx_bench_drain(SEXP con) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  processx_pollable_t pollable;
+  double start, bytes = 0, lines = 0;
+  const char *names[] = { "bytes", "lines", "time", "" };
+  char buffer[64 * 1024];
+  SEXP result;
+
+  if (!ccon) error("Invalid connection object");
+
+  start = processx__now();
+  processx_c_pollable_from_connection(&pollable, ccon);
+
+  while (!processx_c_connection_is_eof(ccon)) {
+    ssize_t i, n;
+    const void *vmax = vmaxget();
+    processx_c_connection_poll(&pollable, 1, -1);
+    vmaxset(vmax);
+    n = processx_c_connection_read_chars(ccon, buffer, sizeof(buffer));
+    bytes += n;
+    for (i = 0; i < n; i++) if (buffer[i] == '\n') lines++;
+  }
+
+  result = PROTECT(mkNamed(REALSXP, names));
+  REAL(result)[0] = bytes;
+  REAL(result)[1] = lines;
+  REAL(result)[2] = processx__now() - start;
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Poll the standard output and error of the processes `reps` times,
+   with a zero timeout. Returns the time of each poll. */
+
+SEXP processx_bench_poll(SEXP statuses, SEXP reps) {
+  int i, num_proc = LENGTH(statuses), creps = INTEGER(reps)[0];
+  processx_pollable_t *pollables;
+  SEXP result;
+
+  pollables = (processx_pollable_t*)
+    R_alloc(num_proc * 2, sizeof(processx_pollable_t));
+
+  for (i = 0; i < num_proc; i++) {
+    processx_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+    if (!handle) error("Internal processx error, handle already removed");
+    processx_c_pollable_from_connection(&pollables[2 * i], handle->pipes[1]);
+    processx_c_pollable_from_connection(&pollables[2 * i + 1],
+					handle->pipes[2]);
+  }
+
+  result = PROTECT(allocVector(REALSXP, creps));
+  for (i = 0; i < creps; i++) {
+    const void *vmax = vmaxget();
+    double start = processx__now();
+    processx_c_connection_poll(pollables, num_proc * 2, 0);
+    REAL(result)[i] = processx__now() - start;
+    vmaxset(vmax);
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Query whether the processes are alive, `reps` times. Returns the time
+   of each round, i.e. for all processes. */
+
+SEXP processx_bench_is_alive(SEXP statuses, SEXP reps) {
+  int i, j, num_proc = LENGTH(statuses), creps = INTEGER(reps)[0];
+  SEXP result = PROTECT(allocVector(REALSXP, creps));
+
+  for (i = 0; i < creps; i++) {
+    double start = processx__now();
+    for (j = 0; j < num_proc; j++) {
+      processx_is_alive(VECTOR_ELT(statuses, j));
+    }
+    REAL(result)[i] = processx__now() - start;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
@@ -0,0 +1,338 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "processx.h"
+
+/* Bounded capture of an output stream, for run()
+ *
+ * The output is added in chunks of UTF-8 text. The first `head_cap`
+ * bytes are kept in the head, and after that the last `tail_cap` bytes
+ * in a ring buffer. Both buffers grow geometrically, up to their caps,
+ * so memory use is bounded, no matter how much output the process
+ * writes, and a large cap costs nothing if the process is quiet. If
+ * `head_cap` is SIZE_MAX, then everything is kept in the head, this is
+ * the default for run().
+ *
+ * If `tail_lines` is not zero, then the tail keeps the last `tail_lines`
+ * lines instead, however long they are. The tail buffer grows as needed,
+ * and a ring of line starts tells which part of it is still needed. In
+ * this mode memory use depends on the length of the kept lines. The tail
+ * is never cut in the middle of a UTF-8 character.
+ */
+
+typedef struct {
+  char *head;
+  size_t head_cap;		/* SIZE_MAX: no limit */
+  size_t head_size;
+  size_t head_alloc;
+  char *tail;
+  size_t tail_cap;
+  size_t tail_start;		/* oldest byte in the ring */
+  size_t tail_size;
+  size_t tail_lines;		/* 0: byte ring, otherwise line mode */
+  size_t tail_alloc;
+  double total;			/* all bytes ever added */
+
+  /* Line mode. Positions are counted in the output that goes to the
+     tail. The tail buffer holds `tail_size` bytes from `tail_start`,
+     and they start at position `tail_pos`. */
+  uint64_t tail_pos;
+  uint64_t tail_total;		/* bytes added to the tail */
+  uint64_t *starts;		/* ring of the last `tail_lines + 1` starts */
+  size_t starts_first;
+  size_t starts_size;
+} processx_capture_t;
+
+#define PROCESSX__UTF8_CONT(c) (((c) & 0xc0) == 0x80)
+
+#define PROCESSX__CAPTURE_INITIAL (64 * 1024)
+
+static void processx__capture_free(processx_capture_t *cap) {
+  if (!cap) return;
+  free(cap->head);
+  free(cap->tail);
+  free(cap->starts);
+  free(cap);
+}
+
+static void processx__capture_finalizer(SEXP xcap) {
+  processx_capture_t *cap = R_ExternalPtrAddr(xcap);
+  processx__capture_free(cap);
+  R_ClearExternalPtr(xcap);
+}
+
+SEXP processx_capture_new(SEXP head, SEXP tail, SEXP tail_lines) {
+  double chead = REAL(head)[0], ctail = REAL(tail)[0];
+  processx_capture_t *cap = calloc(1, sizeof(processx_capture_t));
+  SEXP result;
+
+  if (!cap) error("Cannot allocate output capture");
+  cap->head_cap = R_FINITE(chead) ? (size_t) chead : SIZE_MAX;
+  cap->tail_cap = (size_t) ctail;
+  cap->tail_lines = (size_t) REAL(tail_lines)[0];
+
+  cap->head_alloc = cap->head_cap < PROCESSX__CAPTURE_INITIAL ?
+    cap->head_cap : PROCESSX__CAPTURE_INITIAL;
+  if (cap->tail_lines) {
+    cap->tail_cap = 0;
+    cap->tail_alloc = 4096;
+    cap->tail = malloc(cap->tail_alloc);
+    cap->starts = malloc((cap->tail_lines + 1) * sizeof(uint64_t));
+    if (!cap->tail || !cap->starts) {
+      processx__capture_free(cap);
+      error("Cannot allocate output capture");
+    }
+    /* The first line starts at the beginning */
+    cap->starts[0] = 0;
+    cap->starts_size = 1;
+  }
+
+  if (cap->head_alloc) cap->head = malloc(cap->head_alloc);
+  if (cap->head_alloc && !cap->head) {
+    processx__capture_free(cap);
+    error("Cannot allocate output capture");
+  }
+
+  result = PROTECT(R_MakeExternalPtr(cap, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(result, processx__capture_finalizer, 1);
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Grow a buffer geometrically, to hold at least `size` bytes, but not
+   more than `max` */
+
+static void processx__capture_grow(char **buf, size_t *alloc, size_t size,
+				   size_t max) {
+  size_t newalloc = *alloc ? *alloc : PROCESSX__CAPTURE_INITIAL;
+  char *newbuf;
+  while (newalloc < size && newalloc < max) newalloc *= 2;
+  if (newalloc > max) newalloc = max;
+  newbuf = realloc(*buf, newalloc);
+  if (!newbuf) error("Cannot allocate memory for output capture");
+  *buf = newbuf;
+  *alloc = newalloc;
+}
+
+static void processx__capture_add_head(processx_capture_t *cap,
+				       const char **ptr, size_t *len) {
+  size_t n = *len;
+
+  if (cap->head_cap != SIZE_MAX && n > cap->head_cap - cap->head_size) {
+    n = cap->head_cap - cap->head_size;
+    /* Do not cut a character in half, the rest goes to the tail */
+    while (n > 0 && PROCESSX__UTF8_CONT((*ptr)[n])) n--;
+    cap->head_cap = cap->head_size + n;
+  }
+
+  if (cap->head_size + n > cap->head_alloc) {
+    processx__capture_grow(&cap->head, &cap->head_alloc, cap->head_size + n,
+			   cap->head_cap);
+  }
+
+  memcpy(cap->head + cap->head_size, *ptr, n);
+  cap->head_size += n;
+  *ptr += n;
+  *len -= n;
+}
+
+static void processx__capture_add_tail(processx_capture_t *cap,
+				       const char *ptr, size_t len) {
+  size_t end, first;
+
+  if (cap->tail_cap == 0) return;
+
+  /* Until the buffer reaches the cap, the ring does not wrap around and
+     starts at the beginning, so realloc() keeps the data in order */
+  if (cap->tail_alloc < cap->tail_cap &&
+      cap->tail_size + len > cap->tail_alloc) {
+    processx__capture_grow(&cap->tail, &cap->tail_alloc,
+			   cap->tail_size + len, cap->tail_cap);
+  }
+
+  if (len >= cap->tail_cap) {
+    memcpy(cap->tail, ptr + len - cap->tail_cap, cap->tail_cap);
+    cap->tail_start = 0;
+    cap->tail_size = cap->tail_cap;
+    return;
+  }
+
+  end = (cap->tail_start + cap->tail_size) % cap->tail_cap;
+  first = cap->tail_cap - end;
+  if (first > len) first = len;
+  memcpy(cap->tail + end, ptr, first);
+  memcpy(cap->tail, ptr + first, len - first);
+
+  if (cap->tail_size + len > cap->tail_cap) {
+    size_t over = cap->tail_size + len - cap->tail_cap;
+    cap->tail_start = (cap->tail_start + over) % cap->tail_cap;
+    cap->tail_size = cap->tail_cap;
+  } else {
+    cap->tail_size += len;
+  }
+}
+
+/* Line mode. The oldest start in the ring is the start of the oldest
+   line that we might need, everything before it is dropped. */
+
+static void processx__capture_add_lines(processx_capture_t *cap,
+					const char *ptr, size_t len) {
+  size_t nring = cap->tail_lines + 1, skip;
+  const char *nl, *end = ptr + len;
+  uint64_t pos = cap->tail_total, keep;
+
+  for (nl = ptr; (nl = memchr(nl, '\n', end - nl)); nl++) {
+    uint64_t start = pos + (nl - ptr) + 1;
+    if (cap->starts_size < nring) {
+      cap->starts[(cap->starts_first + cap->starts_size++) % nring] = start;
+    } else {
+      cap->starts[cap->starts_first] = start;
+      cap->starts_first = (cap->starts_first + 1) % nring;
+    }
+  }
+  cap->tail_total += len;
+
+  /* Drop the lines that are not needed any more, from the buffer, and
+     from the new output */
+  keep = cap->starts[cap->starts_first];
+  if (keep >= cap->tail_pos + cap->tail_size) {
+    cap->tail_start = cap->tail_size = 0;
+    cap->tail_pos = keep;
+  } else {
+    cap->tail_start += keep - cap->tail_pos;
+    cap->tail_size -= keep - cap->tail_pos;
+    cap->tail_pos = keep;
+  }
+  skip = cap->tail_pos + cap->tail_size - pos;
+  ptr += skip;
+  len -= skip;
+  if (len == 0) return;
+
+  /* Make space, by moving the data to the front, and growing the buffer
+     if it would be more than half full after that */
+  if (cap->tail_start + cap->tail_size + len > cap->tail_alloc) {
+    memmove(cap->tail, cap->tail + cap->tail_start, cap->tail_size);
+    cap->tail_start = 0;
+    if (2 * (cap->tail_size + len) > cap->tail_alloc) {
+      size_t newalloc = cap->tail_alloc;
+      char *newtail;
+      while (newalloc < 2 * (cap->tail_size + len)) newalloc *= 2;
+      newtail = realloc(cap->tail, newalloc);
+      if (!newtail) error("Cannot allocate memory for output capture");
+      cap->tail = newtail;
+      cap->tail_alloc = newalloc;
+    }
+  }
+
+  memcpy(cap->tail + cap->tail_start + cap->tail_size, ptr, len);
+  cap->tail_size += len;
+}
+
+SEXP processx_capture_add(SEXP xcap, SEXP text) {
+  processx_capture_t *cap = R_ExternalPtrAddr(xcap);
+  const char *ptr;
+  size_t len;
+
+  if (!cap) error("Invalid output capture");
+  if (LENGTH(text) == 0 || STRING_ELT(text, 0) == NA_STRING) {
+    return R_NilValue;
+  }
+
+  ptr = CHAR(STRING_ELT(text, 0));
+  len = LENGTH(STRING_ELT(text, 0));
+  cap->total += len;
+
+  if (cap->head_size < cap->head_cap) {
+    processx__capture_add_head(cap, &ptr, &len);
+  }
+  if (len > 0 && cap->tail_lines) {
+    processx__capture_add_lines(cap, ptr, len);
+  } else if (len > 0) {
+    processx__capture_add_tail(cap, ptr, len);
+  }
+
+  return R_NilValue;
+}
+
+/* The last `tail_lines` lines, in line mode. If the output does not end
+   with a newline, then the last, incomplete line counts, too. */
+
+static void processx__capture_get_lines(processx_capture_t *cap,
+					char **tail, size_t *tail_size) {
+  size_t nring = cap->tail_lines + 1, first = cap->starts_first;
+  uint64_t last = cap->starts[(first + cap->starts_size - 1) % nring];
+  uint64_t keep;
+
+  if (last != cap->tail_total && cap->starts_size == nring) {
+    first = (first + 1) % nring;
+  }
+  keep = cap->starts[first];
+
+  *tail = cap->tail + cap->tail_start + (keep - cap->tail_pos);
+  *tail_size = cap->tail_total - keep;
+}
+
+/* The result is the head, a note about the omitted part, if both the
+   head and the tail are kept, and the tail. */
+
+SEXP processx_capture_get(SEXP xcap) {
+  processx_capture_t *cap = R_ExternalPtrAddr(xcap);
+  char *tail, *ptr, note[100] = "";
+  size_t tail_size, notelen = 0, first;
+  double omitted;
+  SEXP result;
+
+  if (!cap) error("Invalid output capture");
+
+  if (cap->tail_lines) {
+    /* Whole lines, nothing to cut */
+    processx__capture_get_lines(cap, &tail, &tail_size);
+    omitted = cap->total - cap->head_size - tail_size;
+
+  } else {
+    /* Linearize the ring */
+    tail = R_alloc(cap->tail_size + 1, 1);
+    tail_size = cap->tail_size;
+    if (tail_size > 0) {
+      first = cap->tail_cap - cap->tail_start;
+      if (first > tail_size) first = tail_size;
+      memcpy(tail, cap->tail + cap->tail_start, first);
+      memcpy(tail + first, cap->tail, tail_size - first);
+    }
+
+    /* If we lost bytes, then drop the partial character */
+    omitted = cap->total - cap->head_size - tail_size;
+    if (omitted > 0) {
+      while (tail_size > 0 && PROCESSX__UTF8_CONT(*tail)) {
+	tail++;
+	tail_size--;
+	omitted++;
+      }
+    }
+  }
+
+  if (omitted > 0 && cap->head_size > 0) {
+    snprintf(note, sizeof(note), "%s[... %.0f bytes omitted ...]\n",
+	     cap->head[cap->head_size - 1] == '\n' ? "" : "\n", omitted);
+    notelen = strlen(note);
+  }
+
+  if (cap->head_size + notelen + tail_size > INT_MAX) {
+    error("Captured output is too large for an R string");
+  }
+
+  ptr = R_alloc(cap->head_size + notelen + tail_size + 1, 1);
+  if (cap->head_size > 0) memcpy(ptr, cap->head, cap->head_size);
+  memcpy(ptr + cap->head_size, note, notelen);
+  memcpy(ptr + cap->head_size + notelen, tail, tail_size);
+
+  result = PROTECT(ScalarString(mkCharLenCE(
+    ptr, cap->head_size + notelen + tail_size, CE_UTF8)));
+
+  UNPROTECT(1);
+  return result;
+}
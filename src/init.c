@@ -10,14 +10,32 @@ SEXP processx__killem_all();
 SEXP run_testthat_tests();
 
 static const R_CallMethodDef callMethods[]  = {
-  { "processx_exec",               (DL_FUNC) &processx_exec,               9 },
+  { "processx_exec",               (DL_FUNC) &processx_exec,              10 },
   { "processx_wait",               (DL_FUNC) &processx_wait,               2 },
+  { "processx_wait_many",          (DL_FUNC) &processx_wait_many,          3 },
   { "processx_is_alive",           (DL_FUNC) &processx_is_alive,           1 },
   { "processx_get_exit_status",    (DL_FUNC) &processx_get_exit_status,    1 },
   { "processx_signal",             (DL_FUNC) &processx_signal,             2 },
   { "processx_kill",               (DL_FUNC) &processx_kill,               2 },
+  { "processx_kill_many",          (DL_FUNC) &processx_kill_many,          2 },
   { "processx_get_pid",            (DL_FUNC) &processx_get_pid,            1 },
+  { "processx_is_alive_many",      (DL_FUNC) &processx_is_alive_many,      1 },
+  { "processx_exit_status_many",   (DL_FUNC) &processx_exit_status_many,   1 },
+  { "processx_pids_many",          (DL_FUNC) &processx_pids_many,          1 },
+  { "processx_get_resource_usage", (DL_FUNC) &processx_get_resource_usage, 1 },
+  { "processx_file_connection",    (DL_FUNC) &processx_file_connection,    4 },
+  { "processx_get_start_status",   (DL_FUNC) &processx_get_start_status,   1 },
   { "processx_poll",               (DL_FUNC) &processx_poll,               2 },
+  { "processx_set_deadline",       (DL_FUNC) &processx_set_deadline,       3 },
+  { "processx_get_deadline",       (DL_FUNC) &processx_get_deadline,       1 },
+  { "processx_stats",              (DL_FUNC) &processx_stats,              0 },
+  { "processx_capture_new",        (DL_FUNC) &processx_capture_new,        3 },
+  { "processx_capture_add",        (DL_FUNC) &processx_capture_add,        2 },
+  { "processx_capture_get",        (DL_FUNC) &processx_capture_get,        1 },
+  { "processx_bench_clock",        (DL_FUNC) &processx_bench_clock,        0 },
+  { "processx_bench_drain",        (DL_FUNC) &processx_bench_drain,        1 },
+  { "processx_bench_poll",         (DL_FUNC) &processx_bench_poll,         2 },
+  { "processx_bench_is_alive",     (DL_FUNC) &processx_bench_is_alive,     2 },
   { "processx__process_exists",    (DL_FUNC) &processx__process_exists,    1 },
   { "processx__killem_all",        (DL_FUNC) &processx__killem_all,        0 },
   { "processx_is_named_pipe_open", (DL_FUNC) &processx_is_named_pipe_open, 1 },
@@ -30,9 +48,15 @@ static const R_CallMethodDef callMethods[]  = {
   { "processx_connection_create",     (DL_FUNC) &processx_connection_create,     2 },
   { "processx_connection_read_chars", (DL_FUNC) &processx_connection_read_chars, 2 },
   { "processx_connection_read_lines", (DL_FUNC) &processx_connection_read_lines, 2 },
+  { "processx_connection_read_raw",   (DL_FUNC) &processx_connection_read_raw,   2 },
+  { "processx_connection_write_bytes", (DL_FUNC) &processx_connection_write_bytes, 2 },
+  { "processx_connection_read_all",   (DL_FUNC) &processx_connection_read_all,   1 },
+  { "processx_connection_read_all_lines", (DL_FUNC) &processx_connection_read_all_lines, 1 },
   { "processx_connection_is_eof",     (DL_FUNC) &processx_connection_is_eof,     1 },
   { "processx_connection_close",      (DL_FUNC) &processx_connection_close,      1 },
   { "processx_connection_poll",       (DL_FUNC) &processx_connection_poll,       2 },
+  { "processx_connection_stats",      (DL_FUNC) &processx_connection_stats,      1 },
+  { "processx_connection_set_buffer_limit", (DL_FUNC) &processx_connection_set_buffer_limit, 4 },
 
   { "run_testthat_tests", (DL_FUNC) &run_testthat_tests, 0 },
 
@@ -43,6 +67,7 @@ void R_init_processx(DllInfo *dll) {
   R_registerRoutines(dll, NULL, callMethods, NULL, NULL);
   R_useDynamicSymbols(dll, FALSE);
   R_forceSymbols(dll, TRUE);
+  processx__init_altrep(dll);
 #ifdef _WIN32
   R_init_processx_win();
 #else
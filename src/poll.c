@@ -1,30 +1,228 @@
 
+#include <math.h>
+#include <limits.h>
+
 #include "processx.h"
 
+/* The shared memory channel is polled as well, if the process has one.
+   If the process was started asynchronously, and poll() has not reported
+   the start yet, then it is polled as well. The elements of the result
+   are named.
+
+   The shared memory channel is closed when we collect the exit status
+   of the writer, so we also poll the notification pipe of the SIGCHLD
+   handler then, and drain the exit queue when it wakes us up. */
+
+#ifdef _WIN32
+#define PROCESSX__HANDLE_SHM(h) ((processx_connection_t*) 0)
+#define PROCESSX__HANDLE_STARTING(h) 0
+#else
+#define PROCESSX__HANDLE_SHM(h) ((h)->shm)
+#define PROCESSX__HANDLE_STARTING(h) (!(h)->start_reported &&		\
+				      (h)->start_state != PROCESSX_START_STARTED)
+#endif
+
+static void processx__pollable_from_start(processx_pollable_t *pollable,
+					  processx_handle_t *handle) {
+#ifndef _WIN32
+  pollable->poll_func = processx__poll_func_start;
+  pollable->object = handle;
+  pollable->free = 0;
+#endif
+}
+
+/* Deadlines
+ *
+ * A process can have a deadline, on the monotonic clock. `processx_poll()`
+ * does not wait past the next deadline event of the processes it polls,
+ * and it carries out the event after polling, so the kill is not late,
+ * even if the poll was long. At the deadline the process group gets a
+ * SIGTERM, and a SIGKILL after the grace period, if it is still alive.
+ * Without a grace period, and on Windows, it is killed at the deadline.
+ */
+
+SEXP processx_set_deadline(SEXP status, SEXP timeout, SEXP grace) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  double ctimeout = REAL(timeout)[0];
+
+  if (!handle) error("Internal processx error, handle already removed");
+
+  if (!R_FINITE(ctimeout)) {
+    handle->deadline_state = PROCESSX_DEADLINE_NONE;
+  } else {
+    handle->deadline = processx__now() + (ctimeout > 0 ? ctimeout : 0);
+    handle->deadline_grace = REAL(grace)[0];
+    handle->deadline_state = PROCESSX_DEADLINE_ARMED;
+  }
+  handle->killed_at = 0;
+
+  return R_NilValue;
+}
+
+/* Seconds since the deadline killed the process, or NA */
+
+SEXP processx_get_deadline(SEXP status) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+
+  if (!handle) error("Internal processx error, handle already removed");
+
+  if (handle->killed_at == 0) return ScalarReal(NA_REAL);
+  return ScalarReal(processx__now() - handle->killed_at);
+}
+
+static double processx__deadline_next(processx_handle_t *handle) {
+  switch (handle->deadline_state) {
+  case PROCESSX_DEADLINE_ARMED:
+    return handle->deadline;
+  case PROCESSX_DEADLINE_TERM:
+    return handle->deadline + handle->deadline_grace;
+  default:
+    return 0;
+  }
+}
+
+static void processx__deadline_fire(SEXP status, processx_handle_t *handle,
+				    double now) {
+  if (!LOGICAL(processx_is_alive(status))[0]) {
+    handle->deadline_state = PROCESSX_DEADLINE_DONE;
+    return;
+  }
+
+#ifndef _WIN32
+  if (handle->deadline_state == PROCESSX_DEADLINE_ARMED &&
+      handle->deadline_grace > 0) {
+    if (kill(-handle->pid, SIGTERM) == 0) {
+      handle->killed_at = now;
+      handle->deadline_state = PROCESSX_DEADLINE_TERM;
+      return;
+    }
+  }
+#endif
+
+  processx_kill(status, ScalarReal(0));
+  if (handle->killed_at == 0) handle->killed_at = now;
+  handle->deadline_state = PROCESSX_DEADLINE_DONE;
+}
+
 SEXP processx_poll(SEXP statuses, SEXP ms) {
   int cms = INTEGER(ms)[0];
-  int i, num_proc = LENGTH(statuses);
+  int i, j, num_proc = LENGTH(statuses);
+  int *first, *start;
+  int exits = 0;
   processx_pollable_t *pollables;
+  double next = 0, poll_start;
   SEXP result;
 
   pollables = (processx_pollable_t*)
-    R_alloc(num_proc * 2, sizeof(processx_pollable_t));
+    R_alloc(num_proc * 4 + 1, sizeof(processx_pollable_t));
+  first = (int*) R_alloc(num_proc + 1, sizeof(int));
+  start = (int*) R_alloc(num_proc, sizeof(int));
 
-  result = PROTECT(allocVector(VECSXP, num_proc));
+#ifndef _WIN32
+  processx__drain_exits();
   for (i = 0; i < num_proc; i++) {
+    processx_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+    if (handle->shm && !handle->collected) exits = 1;
+  }
+  if (exits) {
+    processx__check_sigchld();
+    processx__notify_init();
+    pollables[0].poll_func = processx__poll_func_exits;
+    pollables[0].object = NULL;
+    pollables[0].free = 0;
+  }
+#endif
+
+  result = PROTECT(allocVector(VECSXP, num_proc));
+  for (i = 0, j = exits; i < num_proc; i++) {
     SEXP status = VECTOR_ELT(statuses, i);
     processx_handle_t *handle = R_ExternalPtrAddr(status);
-    processx_c_pollable_from_connection(&pollables[i*2], handle->pipes[1]);
-    processx_c_pollable_from_connection(&pollables[i*2+1], handle->pipes[2]);
-    SET_VECTOR_ELT(result, i, allocVector(INTSXP, 2));
+    processx_connection_t *shm = PROCESSX__HANDLE_SHM(handle);
+    double hnext = processx__deadline_next(handle);
+    SEXP res, names;
+    int n = 2;
+    if (hnext > 0 && (next == 0 || hnext < next)) next = hnext;
+    first[i] = j;
+    start[i] = -1;
+    processx_c_pollable_from_connection(&pollables[j++], handle->pipes[1]);
+    processx_c_pollable_from_connection(&pollables[j++], handle->pipes[2]);
+    if (shm) processx_c_pollable_from_connection(&pollables[j++], shm);
+    if (PROCESSX__HANDLE_STARTING(handle)) {
+      start[i] = j;
+      processx__pollable_from_start(&pollables[j++], handle);
+    }
+    res = PROTECT(allocVector(INTSXP, j - first[i]));
+    names = PROTECT(allocVector(STRSXP, j - first[i]));
+    SET_STRING_ELT(names, 0, mkChar("output"));
+    SET_STRING_ELT(names, 1, mkChar("error"));
+    if (shm) SET_STRING_ELT(names, n++, mkChar("shm"));
+    if (start[i] >= 0) SET_STRING_ELT(names, n++, mkChar("start"));
+    setAttrib(res, R_NamesSymbol, names);
+    SET_VECTOR_ELT(result, i, res);
+    UNPROTECT(2);
+  }
+  first[num_proc] = j;
+
+  /* Do not sleep past the next deadline, rounding up, so we do not
+     wake up just before it */
+  if (next > 0) {
+    double dms = ceil((next - processx__now()) * 1000);
+    if (dms < 0) dms = 0;
+    if (dms > INT_MAX) dms = INT_MAX;
+    if (cms < 0 || dms < cms) cms = (int) dms;
+  }
+
+  /* If only the notification pipe woke us up, then we poll again, for
+     the rest of the timeout. The exits pollable comes first, so the
+     next round sees the closed shared memory channels. */
+  poll_start = processx__now();
+  while (1) {
+    int ready = processx_c_connection_poll(pollables, j, cms);
+    if (!exits || pollables[0].event != PXREADY || ready > 1) break;
+    if (cms > 0) {
+      cms -= (processx__now() - poll_start) * 1000;
+      if (cms < 0) cms = 0;
+      poll_start = processx__now();
+    }
+  }
+
+  if (next > 0) {
+    double now = processx__now();
+    for (i = 0; i < num_proc; i++) {
+      SEXP status = VECTOR_ELT(statuses, i);
+      processx_handle_t *handle = R_ExternalPtrAddr(status);
+      double hnext = processx__deadline_next(handle);
+      if (hnext > 0 && now >= hnext) {
+	processx__deadline_fire(status, handle, now);
+      }
+    }
   }
 
-  processx_c_connection_poll(pollables, num_proc * 2, cms);
+  for (i = 0; i < num_proc; i++) {
+    for (j = first[i]; j < first[i + 1]; j++) {
+      INTEGER(VECTOR_ELT(result, i))[j - first[i]] = pollables[j].event;
+    }
+  }
 
+#ifndef _WIN32
+  /* The exec status pipe is ready, so we read it now */
   for (i = 0; i < num_proc; i++) {
-    INTEGER(VECTOR_ELT(result, i))[0] = pollables[i*2].event;
-    INTEGER(VECTOR_ELT(result, i))[1] = pollables[i*2+1].event;
+    processx_handle_t *handle;
+    int event;
+    if (start[i] < 0) continue;
+    handle = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+    event = pollables[start[i]].event;
+    if (event == PXREADY) {
+      int state = processx__start_status(handle, /* block= */ 0);
+      event = state == PROCESSX_START_STARTED ? PXSTARTED :
+	state == PROCESSX_START_EXEC_FAILED ? PXEXECFAILED : PXSILENT;
+    }
+    if (event == PXSTARTED || event == PXEXECFAILED) {
+      handle->start_reported = 1;
+    }
+    INTEGER(VECTOR_ELT(result, i))[start[i] - first[i]] = event;
   }
+#endif
 
   UNPROTECT(1);
   return result;
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -25,11 +26,15 @@ static void processx__connection_find_chars(processx_connection_t *ccon,
 static void processx__connection_find_lines(processx_connection_t *ccon,
 					    ssize_t maxlines,
 					    size_t *lines,
-					    int *eof);
+					    int *eof, int *split);
 
 static void processx__connection_alloc(processx_connection_t *ccon);
 static void processx__connection_realloc(processx_connection_t *ccon);
 static ssize_t processx__connection_read(processx_connection_t *ccon);
+static int processx__connection_throttled(processx_connection_t *ccon);
+static int processx__connection_line_too_long(processx_connection_t *ccon);
+static size_t processx__connection_piece_size(processx_connection_t *ccon);
+static int processx__connection_split_end(processx_connection_t *ccon);
 static ssize_t processx__find_newline(processx_connection_t *ccon,
 				      size_t start);
 static ssize_t processx__connection_read_until_newline(processx_connection_t
@@ -58,6 +63,13 @@ static void processx__connection_find_utf8_chars(processx_connection_t *ccon,
   } while (0)
 #endif
 
+/* Whether the connection is read by the I/O thread, Unix only */
+#ifdef _WIN32
+#define PROCESSX__READAHEAD(x) 0
+#else
+#define PROCESSX__READAHEAD(x) ((x)->readahead != 0)
+#endif
+
 /* --------------------------------------------------------------------- */
 /* API from R                                                            */
 /* --------------------------------------------------------------------- */
@@ -87,6 +99,7 @@ SEXP processx_connection_read_chars(SEXP con, SEXP nchars) {
   result = PROTECT(ScalarString(mkCharLenCE(ccon->utf8, utf8_bytes,
 					    CE_UTF8)));
   ccon->utf8_data_size -= utf8_bytes;
+  PROCESSX__STAT_ADD(ccon, memmove_bytes, ccon->utf8_data_size);
   memmove(ccon->utf8, ccon->utf8 + utf8_bytes, ccon->utf8_data_size);
 
   UNPROTECT(1);
@@ -100,10 +113,10 @@ SEXP processx_connection_read_lines(SEXP con, SEXP nlines) {
   int cn = asInteger(nlines);
   ssize_t newline, eol = -1;
   size_t lines_read = 0, l;
-  int eof = 0;
+  int eof = 0, split = 0;
   int slashr;
 
-  processx__connection_find_lines(ccon, cn, &lines_read, &eof);
+  processx__connection_find_lines(ccon, cn, &lines_read, &eof, &split);
 
   result = PROTECT(allocVector(STRSXP, lines_read + eof));
   for (l = 0, newline = -1; l < lines_read; l++) {
@@ -116,7 +129,11 @@ SEXP processx_connection_read_lines(SEXP con, SEXP nlines) {
   }
 
   if (eof) {
-    eol = ccon->utf8_data_size - 1;
+    if (split) {
+      eol = processx__connection_piece_size(ccon) - 1;
+    } else {
+      eol = ccon->utf8_data_size - 1;
+    }
     SET_STRING_ELT(
       result, l,
       mkCharLenCE(ccon->utf8 + newline + 1, eol - newline, CE_UTF8));
@@ -124,6 +141,7 @@ SEXP processx_connection_read_lines(SEXP con, SEXP nlines) {
 
   if (eol >= 0) {
     ccon->utf8_data_size -= eol + 1;
+    PROCESSX__STAT_ADD(ccon, memmove_bytes, ccon->utf8_data_size);
     memmove(ccon->utf8, ccon->utf8 + eol + 1, ccon->utf8_data_size);
   }
 
@@ -150,6 +168,123 @@ SEXP processx_connection_is_closed(SEXP con) {
   return ScalarLogical(processx_c_connection_is_closed(ccon));
 }
 
+SEXP processx_connection_set_buffer_limit(SEXP con, SEXP high, SEXP low,
+					  SEXP split_lines) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  if (!ccon) error("Invalid connection object");
+  ccon->buffer_high = REAL(high)[0];
+  ccon->buffer_low = REAL(low)[0];
+  ccon->split_lines = LOGICAL(split_lines)[0];
+  ccon->throttled = 0;
+  return R_NilValue;
+}
+
+SEXP processx_connection_read_raw(SEXP con, SEXP nbytes) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  size_t cnbytes = asInteger(nbytes);
+  ssize_t bytes_read;
+  SEXP result;
+
+  if (!ccon) error("Invalid connection object");
+
+  result = PROTECT(allocVector(RAWSXP, cnbytes));
+  bytes_read = processx_c_connection_read_bytes(ccon, RAW(result), cnbytes);
+  if (bytes_read < cnbytes) result = lengthgets(result, bytes_read);
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Read until EOF, into a single buffer, and create the result once.
+   The buffer is a raw vector, that grows geometrically, so it is
+   released on an interrupt as well. */
+
+static SEXP processx__connection_drain(processx_connection_t *ccon,
+				       size_t *size) {
+  size_t cap = 64 * 1024;
+  processx_pollable_t pollable;
+  PROTECT_INDEX ipx;
+  SEXP buf;
+
+  PROTECT_WITH_INDEX(buf = allocVector(RAWSXP, cap), &ipx);
+  *size = 0;
+  processx_c_pollable_from_connection(&pollable, ccon);
+
+  while (!processx_c_connection_is_eof(ccon)) {
+    ssize_t n;
+    /* Keep room for at least a few UTF-8 characters */
+    if (cap - *size < 64) {
+      SEXP newbuf = allocVector(RAWSXP, cap * 2);
+      memcpy(RAW(newbuf), RAW(buf), *size);
+      REPROTECT(buf = newbuf, ipx);
+      cap *= 2;
+    }
+    n = processx_c_connection_read_chars(ccon, RAW(buf) + *size,
+					 cap - *size);
+    *size += n;
+    if (n == 0 && !processx_c_connection_is_eof(ccon)) {
+      const void *vmax = vmaxget();
+      processx_c_connection_poll(&pollable, 1, -1);
+      vmaxset(vmax);
+    }
+  }
+
+  if (*size > INT_MAX) error("Output is too large for an R string");
+
+  UNPROTECT(1);
+  return buf;
+}
+
+SEXP processx_connection_read_all(SEXP con) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  size_t size;
+  SEXP buf, result;
+
+  if (!ccon) error("Invalid connection object");
+
+  buf = PROTECT(processx__connection_drain(ccon, &size));
+  result = PROTECT(ScalarString(mkCharLenCE((char*) RAW(buf), size,
+					    CE_UTF8)));
+
+  UNPROTECT(2);
+  return result;
+}
+
+/* Lines are split the same way as in processx_connection_read_lines:
+   a \r before the newline is dropped, and the last line does not need
+   a newline. The result is an ALTREP vector, see altrep.c. */
+
+SEXP processx_connection_read_all_lines(SEXP con) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  size_t size;
+  SEXP buf, result;
+
+  if (!ccon) error("Invalid connection object");
+
+  buf = PROTECT(processx__connection_drain(ccon, &size));
+  result = processx__lines_new(buf, size);
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Returns the bytes that could not be written now */
+SEXP processx_connection_write_bytes(SEXP con, SEXP bytes) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  size_t cnbytes = XLENGTH(bytes);
+  ssize_t written;
+  SEXP result;
+
+  if (!ccon) error("Invalid connection object");
+
+  written = processx_c_connection_write_bytes(ccon, RAW(bytes), cnbytes);
+  result = PROTECT(allocVector(RAWSXP, cnbytes - written));
+  memcpy(RAW(result), RAW(bytes) + written, cnbytes - written);
+
+  UNPROTECT(1);
+  return result;
+}
+
 /* Poll connections and other pollable handles */
 SEXP processx_connection_poll(SEXP pollables, SEXP timeout) {
   /* TODO: this is not used currently */
@@ -185,6 +320,25 @@ processx_connection_t *processx_c_connection_create(
   con->utf8_allocated_size = 0;
   con->utf8_data_size = 0;
 
+  con->buffer_high = 0;
+  con->buffer_low = 0;
+  con->throttled = 0;
+  con->split_lines = 0;
+  con->split_pending = 0;
+
+  memset(&con->stats, 0, sizeof(con->stats));
+
+#ifndef _WIN32
+  con->shm = 0;
+  con->shm_map_size = 0;
+  con->file_done_fd = con->file_notify_fd = con->file_poll_fd = -1;
+  con->file_done = 0;
+  con->file_offset = 0;
+  con->file_map = 0;
+  con->file_map_size = 0;
+  con->readahead = 0;
+#endif
+
   con->encoding = 0;
   if (encoding && encoding[0]) {
     con->encoding = strdup(encoding);
@@ -239,6 +393,10 @@ void processx_c_connection_destroy(processx_connection_t *ccon) {
   if (ccon->utf8) free(ccon->utf8);
   if (ccon->encoding) free(ccon->encoding);
 
+#ifndef _WIN32
+  if (ccon->shm) processx__shm_unmap(ccon);
+#endif
+
   free(ccon);
 }
 
@@ -257,11 +415,159 @@ ssize_t processx_c_connection_read_chars(processx_connection_t *ccon,
 
   memcpy(buffer, ccon->utf8, utf8_bytes);
   ccon->utf8_data_size -= utf8_bytes;
+  PROCESSX__STAT_ADD(ccon, memmove_bytes, ccon->utf8_data_size);
   memmove(ccon->utf8, ccon->utf8 + utf8_bytes, ccon->utf8_data_size);
 
   return utf8_bytes;
 }
 
+/**
+ * Read raw bytes
+ *
+ * The bytes are not re-encoded. Data that was already converted to UTF-8
+ * (e.g. by a previous poll) is served first, so mixing raw and character
+ * reads is only safe if the connection is UTF-8 encoded.
+ *
+ * @return Number of bytes read. At EOF zero is returned, and the
+ *   connection's EOF flag is set.
+ */
+ssize_t processx_c_connection_read_bytes(processx_connection_t *ccon,
+					 void *buffer,
+					 size_t nbyte) {
+  size_t done = 0, n;
+
+  PROCESSX_CHECK_VALID_CONN(ccon);
+
+#ifndef _WIN32
+  /* With read-ahead, the I/O thread has the data, already in UTF-8 */
+  if (ccon->readahead && ccon->utf8_data_size < nbyte) {
+    processx__connection_read(ccon);
+  }
+#endif
+
+  n = ccon->utf8_data_size < nbyte ? ccon->utf8_data_size : nbyte;
+  if (n > 0) {
+    memcpy(buffer, ccon->utf8, n);
+    ccon->utf8_data_size -= n;
+    PROCESSX__STAT_ADD(ccon, memmove_bytes, ccon->utf8_data_size);
+    memmove(ccon->utf8, ccon->utf8 + n, ccon->utf8_data_size);
+    done += n;
+  }
+
+  n = ccon->buffer_data_size < nbyte - done ?
+    ccon->buffer_data_size : nbyte - done;
+  if (n > 0) {
+    memcpy((char*) buffer + done, ccon->buffer, n);
+    ccon->buffer_data_size -= n;
+    PROCESSX__STAT_ADD(ccon, memmove_bytes, ccon->buffer_data_size);
+    memmove(ccon->buffer, ccon->buffer + n, ccon->buffer_data_size);
+    done += n;
+  }
+
+  if (done < nbyte && !ccon->is_eof_raw_ && !PROCESSX__READAHEAD(ccon)) {
+#ifdef _WIN32
+    if (done == 0) {
+      error("Reading raw bytes is not implemented on Windows yet");
+    }
+#else
+    ssize_t ret;
+    if (ccon->type == PROCESSX_FILE_TYPE_SHMRING) {
+      ret = processx__shm_read(ccon, (char*) buffer + done, nbyte - done);
+    } else if (ccon->type == PROCESSX_FILE_TYPE_FILE) {
+      ret = processx__file_read(ccon, (char*) buffer + done, nbyte - done);
+    } else {
+      ret = read(ccon->handle, (char*) buffer + done, nbyte - done);
+    }
+    PROCESSX__STAT_ADD(ccon, read_calls, 1);
+    PROCESSX_TRACE3(read, ccon->handle, nbyte - done, ret);
+    if (ret == 0) {
+      ccon->is_eof_raw_ = 1;
+    } else if (ret == -1 && errno == EAGAIN) {
+      PROCESSX__STAT_ADD(ccon, eagain, 1);
+    } else if (ret == -1) {
+      error("Cannot read from processx connection: %s", strerror(errno));
+    } else {
+      PROCESSX__STAT_ADD(ccon, bytes_read, ret);
+      done += ret;
+    }
+#endif
+  }
+
+  if (ccon->is_eof_raw_ && ccon->buffer_data_size == 0 &&
+      ccon->utf8_data_size == 0) {
+    ccon->is_eof_ = 1;
+  }
+
+  return done;
+}
+
+/**
+ * Write raw bytes
+ *
+ * The connection is non-blocking, so this writes as much as the pipe
+ * takes now. A closed pipe (the process exited, or closed its standard
+ * input) is an error.
+ *
+ * @return Number of bytes written.
+ */
+ssize_t processx_c_connection_write_bytes(processx_connection_t *ccon,
+					  const void *buffer,
+					  size_t nbyte) {
+  ssize_t ret;
+
+  PROCESSX_CHECK_VALID_CONN(ccon);
+  if (nbyte == 0) return 0;
+
+#ifdef _WIN32
+  error("Writing to processx connections is not implemented on Windows yet");
+  ret = 0;
+#else
+  do {
+#ifdef MSG_NOSIGNAL
+    ret = send(ccon->handle, buffer, nbyte, MSG_NOSIGNAL);
+    if (ret == -1 && errno == ENOTSOCK) {
+      ret = write(ccon->handle, buffer, nbyte);
+    }
+#else
+    ret = write(ccon->handle, buffer, nbyte);
+#endif
+  } while (ret == -1 && errno == EINTR);
+
+  if (ret == -1 && errno == EAGAIN) {
+    ret = 0;
+  } else if (ret == -1) {
+    error("Cannot write to processx connection: %s", strerror(errno));
+  }
+#endif
+
+  return ret;
+}
+
+/* Zero-copy reads from shared memory */
+int processx_c_connection_shm_peek(processx_connection_t *ccon,
+				   const char **ptr, size_t *nbyte) {
+#ifdef _WIN32
+  error("Shared memory channels are only supported on Linux");
+  return -1;
+#else
+  int ret;
+  PROCESSX_CHECK_VALID_CONN(ccon);
+  if (ccon->type != PROCESSX_FILE_TYPE_SHMRING) {
+    error("Not a shared memory processx connection");
+  }
+  ret = processx__shm_peek(ccon, ptr, nbyte);
+  if (ret == -1) ccon->is_eof_raw_ = ccon->is_eof_ = 1;
+  return ret;
+#endif
+}
+
+void processx_c_connection_shm_consume(processx_connection_t *ccon,
+				       size_t nbyte) {
+#ifndef _WIN32
+  processx__shm_consume(ccon, nbyte);
+#endif
+}
+
 /**
  * Read a single line, ending with \n
  *
@@ -282,8 +588,9 @@ ssize_t processx_c_connection_read_chars(processx_connection_t *ccon,
 ssize_t processx_c_connection_read_line(processx_connection_t *ccon,
 					char **linep, size_t *linecapp) {
 
-  int eof = 0;
-  ssize_t newline;
+  int eof = 0, split = 0;
+  ssize_t newline, len;
+  size_t used;
 
   if (!linep) error("linep cannot be a null pointer");
   if (!linecapp) error("linecapp cannot be a null pointer");
@@ -293,6 +600,9 @@ ssize_t processx_c_connection_read_line(processx_connection_t *ccon,
   /* Read until a newline character shows up, or there is nothing more
      to read (at least for now). */
   newline = processx__connection_read_until_newline(ccon);
+  if (processx__connection_split_end(ccon)) {
+    newline = processx__connection_read_until_newline(ccon);
+  }
 
   /* If there is no newline at the end of the file, we still add the
      last line. */
@@ -302,34 +612,43 @@ ssize_t processx_c_connection_read_line(processx_connection_t *ccon,
     eof = 1;
   }
 
+  /* A line longer than the buffer limit is served in pieces */
+  if (newline == -1 && processx__connection_line_too_long(ccon)) split = 1;
+
   /* We cannot serve a line currently. Maybe later. */
-  if (newline == -1 && ! eof) return 0;
+  if (newline == -1 && ! eof && ! split) return 0;
 
-  /* Newline will contain the end of the line now, even if EOF */
-  if (newline == -1) newline = ccon->utf8_data_size;
-  if (ccon->utf8[newline - 1] == '\r') newline--;
+  /* A piece is served as is, a \r at the end of a line is dropped */
+  if (split) {
+    len = used = processx__connection_piece_size(ccon);
+  } else {
+    if (newline == -1) {
+      len = used = ccon->utf8_data_size;
+    } else {
+      len = newline;
+      used = newline + 1;
+    }
+    if (len > 0 && ccon->utf8[len - 1] == '\r') len--;
+  }
 
   if (! *linep) {
-    *linep = malloc(newline + 1);
-    *linecapp = newline + 1;
-  } else if (*linecapp < newline + 1) {
-    char *tmp = realloc(*linep, newline + 1);
+    *linep = malloc(len + 1);
+    *linecapp = len + 1;
+  } else if (*linecapp < len + 1) {
+    char *tmp = realloc(*linep, len + 1);
     if (!tmp) error("out of memory");
     *linep = tmp;
-    *linecapp = newline + 1;
+    *linecapp = len + 1;
   }
 
-  memcpy(*linep, ccon->utf8, newline);
-  (*linep)[newline] = '\0';
+  memcpy(*linep, ccon->utf8, len);
+  (*linep)[len] = '\0';
 
-  if (!eof) {
-    ccon->utf8_data_size -= (newline + 1);
-    memmove(ccon->utf8, ccon->utf8 + newline + 1, ccon->utf8_data_size);
-  } else {
-    ccon->utf8_data_size = 0;
-  }
+  ccon->utf8_data_size -= used;
+  PROCESSX__STAT_ADD(ccon, memmove_bytes, ccon->utf8_data_size);
+  memmove(ccon->utf8, ccon->utf8 + used, ccon->utf8_data_size);
 
-  return newline;
+  return len;
 }
 
 /* Check if the connection has ended */
@@ -347,6 +666,8 @@ void processx_c_connection_close(processx_connection_t *ccon) {
   }
   ccon->handle.overlapped.hEvent = 0;
 #else
+  if (ccon->type == PROCESSX_FILE_TYPE_FILE) processx__file_close(ccon);
+  if (ccon->readahead) processx__readahead_remove(ccon);
   if (ccon->handle >= 0) close(ccon->handle);
   ccon->handle = -1;
 #endif
@@ -369,6 +690,8 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
   DWORD waitres;
   int timeleft = timeout;
 
+  processx__stats.poll_calls++;
+
   ptr = (int*) R_alloc(npollables, sizeof(int));
   handles = (HANDLE*) R_alloc(npollables, sizeof(HANDLE));
 
@@ -401,6 +724,7 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
       handles,
       /* bWaitAll = */ FALSE,
       PROCESSX_INTERRUPT_INTERVAL);
+    processx__stats.poll_wakeups++;
     if (waitres != WAIT_TIMEOUT) break;
 
     R_CheckUserInterrupt();
@@ -414,6 +738,7 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
       handles,
       /* bWaitAll = */ FALSE,
       timeleft);
+    processx__stats.poll_wakeups++;
   }
 
   if (waitres == WAIT_FAILED) {
@@ -450,6 +775,10 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
   struct pollfd *fds;
   int *ptr;
   int ret;
+  PROCESSX_TRACE_CLOCK(trace_start);
+
+  processx__stats.poll_calls++;
+  PROCESSX_TRACE2(poll__enter, npollables, timeout);
 
   if (npollables == 0) return 0;
 
@@ -465,23 +794,28 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
     el->event = el->poll_func(el->object, 0, &handle, &again);
     if (el->event == PXNOPIPE || el->event == PXCLOSED) {
       /* Do nothing */
-    } else if (el->event == PXREADY) {
-      hasdata++;
     } else if (el->event == PXSILENT && handle >= 0) {
       fds[j].fd = handle;
       fds[j].events = POLLIN;
       fds[j].revents = 0;
       ptr[j] = i;
       j++;
-    } else {
+    } else if (el->event == PXSILENT) {
       error("Cannot poll pollable: not ready and no fd");
+    } else {
+      /* PXREADY, or some other event, e.g. PXSTARTED */
+      hasdata++;
     }
   }
 
   /* j contains the number of fds to poll now */
 
   /* Nothing to poll */
-  if (j == 0) return hasdata;
+  if (j == 0) {
+    PROCESSX_TRACE3(poll__exit, npollables, hasdata,
+		    PROCESSX_TRACE_NS(trace_start));
+    return hasdata;
+  }
 
   /* If we already have some data, then we don't wait any more,
      just check if other connections are ready */
@@ -502,6 +836,8 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
     }
   }
 
+  PROCESSX_TRACE3(poll__exit, npollables, hasdata,
+		  PROCESSX_TRACE_NS(trace_start));
   return hasdata;
 }
 
@@ -527,6 +863,7 @@ void processx__connection_start_read(processx_connection_t *ccon) {
      ccon->handle.overlapped.Offset = 0;
      ccon->handle.overlapped.OffsetHigh = 0;
   }
+  PROCESSX__STAT_ADD(ccon, read_calls, 1);
   res = ReadFile(
     /* hfile = */                ccon->handle.handle,
     /* lpBuffer = */             ccon->buffer + ccon->buffer_data_size,
@@ -551,6 +888,7 @@ void processx__connection_start_read(processx_connection_t *ccon) {
     /* Returned synchronously. */
     ccon->handle.read_pending = FALSE;
     ccon->buffer_data_size += bytes_read;
+    PROCESSX__STAT_ADD(ccon, bytes_read, bytes_read);
     if (ccon->type == PROCESSX_FILE_TYPE_ASYNCFILE) {
       /* TODO: large files */
       ccon->handle.overlapped.Offset += bytes_read;
@@ -603,6 +941,24 @@ int processx_i_poll_func_connection(
   PROCESSX__I_POLL_FUNC_CONNECTION_READY;
   if (handle) *handle = ccon->handle.overlapped.hEvent;
 #else
+  /* For shared memory we can check the ring without a system call */
+  if (ccon->type == PROCESSX_FILE_TYPE_SHMRING && processx__shm_ready(ccon)) {
+    return PXREADY;
+  }
+  /* The I/O thread reads the connection, so we poll its queue instead */
+  if (ccon->readahead) {
+    if (processx__readahead_ready(ccon)) return PXREADY;
+    if (handle) *handle = processx__readahead_fd(ccon);
+    if (again) *again = 0;
+    return PXSILENT;
+  }
+  /* Files are always readable, so we poll for changes instead */
+  if (ccon->type == PROCESSX_FILE_TYPE_FILE) {
+    if (processx__file_ready(ccon)) return PXREADY;
+    if (handle) *handle = ccon->file_poll_fd;
+    if (again) *again = 0;
+    return PXSILENT;
+  }
   if (handle) *handle = ccon->handle;
 #endif
 
@@ -670,17 +1026,21 @@ static void processx__connection_find_chars(processx_connection_t *ccon,
  * @param lines Number of lines found is stored here.
  * @param eof If the end of the file is reached, and there is no `\n`
  *   at the end of the file, this is set to 1.
+ * @param split If the buffer is full, and it has no `\n`, then `eof` and
+ *   this are set to 1, the caller returns a piece of the line, see
+ *   `processx__connection_piece_size()`.
  *
  */
 
 static void processx__connection_find_lines(processx_connection_t *ccon,
 					    ssize_t maxlines,
 					    size_t *lines,
-					    int *eof ) {
+					    int *eof, int *split) {
 
   ssize_t newline;
 
   *eof = 0;
+  *split = 0;
 
   if (maxlines < 0) maxlines = 1000;
 
@@ -689,6 +1049,9 @@ static void processx__connection_find_lines(processx_connection_t *ccon,
   /* Read until a newline character shows up, or there is nothing more
      to read (at least for now). */
   newline = processx__connection_read_until_newline(ccon);
+  if (processx__connection_split_end(ccon)) {
+    newline = processx__connection_read_until_newline(ccon);
+  }
 
   /* Count the number of lines we got. */
   while (newline != -1 && *lines < maxlines) {
@@ -704,6 +1067,10 @@ static void processx__connection_find_lines(processx_connection_t *ccon,
     *eof = 1;
   }
 
+  /* A line longer than the buffer limit is returned in pieces */
+  if (*lines == 0 && processx__connection_line_too_long(ccon)) {
+    *eof = *split = 1;
+  }
 }
 
 static void processx__connection_xfinalizer(SEXP con) {
@@ -747,6 +1114,9 @@ static ssize_t processx__connection_read_until_newline
     /* No newline, but EOF? */
     if (ccon->is_eof_) return -1;
 
+    /* The buffer is full, do not grow it */
+    if (processx__connection_throttled(ccon)) return -1;
+
     /* Maybe we can read more, but might need a bigger utf8.
      * The 8 bytes is definitely more than what we need for a UTF8
      * character, and this makes sure that we don't stop just because
@@ -780,6 +1150,7 @@ static void processx__connection_alloc(processx_connection_t *ccon) {
   }
   ccon->utf8_allocated_size = 64 * 1024;
   ccon->utf8_data_size = 0;
+  PROCESSX__STAT_MAX(ccon, peak_buffer_size, ccon->utf8_allocated_size);
 }
 
 /* We only really need to re-alloc the UTF8 buffer, because the
@@ -790,6 +1161,80 @@ static void processx__connection_realloc(processx_connection_t *ccon) {
   if (!nb) error("Cannot allocate memory for processx line");
   ccon->utf8 = nb;
   ccon->utf8_allocated_size = ccon->utf8_allocated_size * 1.2;
+  PROCESSX__STAT_ADD(ccon, buffer_growths, 1);
+  PROCESSX__STAT_MAX(ccon, peak_buffer_size, ccon->utf8_allocated_size);
+}
+
+/* Backpressure. Above the high-water mark we do not read more from the
+   data source, so the pipe fills up, and the process blocks, instead of
+   the buffer growing without bounds. We start reading again below the
+   low-water mark. The buffer might go above the high-water mark by one
+   read. */
+
+static int processx__connection_throttled(processx_connection_t *ccon) {
+  if (ccon->buffer_high == 0) return 0;
+  if (ccon->utf8_data_size >= ccon->buffer_high) {
+    if (!ccon->throttled) PROCESSX__STAT_ADD(ccon, throttles, 1);
+    ccon->throttled = 1;
+  } else if (ccon->utf8_data_size < ccon->buffer_low) {
+    ccon->throttled = 0;
+  }
+  return ccon->throttled;
+}
+
+/* Called if there is no full line in the buffer. If the buffer is full,
+   then we cannot read the rest of the line, so we either return it in
+   pieces, or fail. */
+
+static int processx__connection_line_too_long(processx_connection_t *ccon) {
+  if (ccon->buffer_high == 0 || ccon->utf8_data_size < ccon->buffer_high) {
+    return 0;
+  }
+  if (!ccon->split_lines) {
+    error("Line is longer than the buffer limit (%.0f bytes) of the "
+	  "processx connection, see `split_lines`",
+	  (double) ccon->buffer_high);
+  }
+  return 1;
+}
+
+/* Size of the next piece of a long line. A \r at the end might be the
+   start of a CRLF, so it is left for the next piece. */
+
+static size_t processx__connection_piece_size(processx_connection_t *ccon) {
+  size_t size = ccon->utf8_data_size;
+  if (size > 1 && ccon->utf8[size - 1] == '\r') size--;
+  ccon->split_pending = 1;
+  return size;
+}
+
+/* After a piece, the buffer starts with the rest of the long line. If
+   the line ended right after the piece, then the rest is just the \n or
+   CRLF, and it is not a line of its own, so we drop it. Returns 1 if it
+   dropped something. */
+
+static int processx__connection_split_end(processx_connection_t *ccon) {
+  size_t skip = 0;
+
+  if (!ccon->split_pending || ccon->utf8_data_size == 0) return 0;
+
+  if (ccon->utf8[0] == '\n') {
+    skip = 1;
+  } else if (ccon->utf8[0] == '\r' && ccon->utf8_data_size == 1) {
+    /* Wait for the \n, unless there is nothing more */
+    if (!ccon->is_eof_raw_ || ccon->buffer_data_size != 0) return 0;
+    skip = 1;
+  } else if (ccon->utf8[0] == '\r' && ccon->utf8[1] == '\n') {
+    skip = 2;
+  }
+
+  ccon->split_pending = 0;
+  if (skip == 0) return 0;
+
+  ccon->utf8_data_size -= skip;
+  PROCESSX__STAT_ADD(ccon, memmove_bytes, ccon->utf8_data_size);
+  memmove(ccon->utf8, ccon->utf8 + skip, ccon->utf8_data_size);
+  return 1;
 }
 
 /* Read as much as we can. This is the only function that explicitly
@@ -805,6 +1250,8 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
   DWORD todo, bytes_read = 0;
   BOOLEAN result;
 
+  if (processx__connection_throttled(ccon)) return 0;
+
   /* Nothing to read, nothing to convert to UTF8 */
   if (ccon->is_eof_raw_ && ccon->buffer_data_size == 0) {
     if (ccon->utf8_data_size == 0) ccon->is_eof_ = 1;
@@ -839,6 +1286,7 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
 	bytes_read = 0;
 
       } else if (err == ERROR_IO_INCOMPLETE) {
+	PROCESSX__STAT_ADD(ccon, eagain, 1);
 
       } else {
 	ccon->handle.read_pending = FALSE;
@@ -849,6 +1297,7 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
     } else {
       ccon->handle.read_pending = FALSE;
       ccon->buffer_data_size += bytes_read;
+      PROCESSX__STAT_ADD(ccon, bytes_read, bytes_read);
       if (ccon->type == PROCESSX_FILE_TYPE_ASYNCFILE) {
 	/* TODO: large files */
 	ccon->handle.overlapped.Offset += bytes_read;
@@ -868,9 +1317,107 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
 
 #else
 
+static void processx__connection_grow_utf8(processx_connection_t *ccon,
+					   size_t newsize) {
+  void *nb = realloc(ccon->utf8, newsize);
+  if (!nb) error("Cannot allocate memory for processx line");
+  ccon->utf8 = nb;
+  ccon->utf8_allocated_size = newsize;
+  PROCESSX__STAT_ADD(ccon, buffer_growths, 1);
+  PROCESSX__STAT_MAX(ccon, peak_buffer_size, newsize);
+}
+
+/* With read-ahead, the I/O thread already read the data, and converted
+   it to UTF-8, so we just copy the queued chunks to the UTF-8 buffer.
+   The first chunk always fits, we grow the buffer if needed. Chunks
+   that were spilled to disk are read from the spill file. */
+
+static ssize_t processx__connection_read_ahead(processx_connection_t *ccon) {
+  processx__chunk_t *chunk;
+  ssize_t copied = 0;
+
+  if (!ccon->utf8) processx__connection_alloc(ccon);
+
+  for (;;) {
+    size_t avail = ccon->utf8_allocated_size - ccon->utf8_data_size;
+
+    if (copied > 0 && processx__connection_throttled(ccon)) break;
+
+    /* Data that was spilled to disk might come before the queue */
+    if (processx__readahead_spilled(ccon)) {
+      ssize_t n;
+      if (avail < 64) {
+	if (copied > 0) break;
+	processx__connection_grow_utf8(ccon, ccon->utf8_data_size + 64 * 1024);
+	avail = ccon->utf8_allocated_size - ccon->utf8_data_size;
+      }
+      n = processx__readahead_spill_read(
+        ccon, ccon->utf8 + ccon->utf8_data_size, avail);
+      ccon->utf8_data_size += n;
+      copied += n;
+      PROCESSX__STAT_ADD(ccon, bytes_read, n);
+      PROCESSX__STAT_ADD(ccon, read_calls, 1);
+      continue;
+    }
+
+    /* This drains the notification pipe if the queue is empty, so we
+       need to check the spill file again after it */
+    chunk = processx__readahead_peek(ccon);
+    if (!chunk) {
+      if (processx__readahead_spilled(ccon)) continue;
+      break;
+    }
+
+    if (chunk->size > avail) {
+      if (copied > 0) break;
+      processx__connection_grow_utf8(ccon,
+				     ccon->utf8_data_size + chunk->size);
+    }
+
+    memcpy(ccon->utf8 + ccon->utf8_data_size, chunk->data, chunk->size);
+    ccon->utf8_data_size += chunk->size;
+    copied += chunk->size;
+    PROCESSX__STAT_ADD(ccon, bytes_read, chunk->raw_bytes);
+    PROCESSX__STAT_ADD(ccon, read_calls, chunk->reads);
+    PROCESSX__STAT_ADD(ccon, iconv_calls, chunk->iconv_calls);
+
+    if (chunk->eof) {
+      int err = chunk->err, invalid_tail = chunk->invalid_tail;
+      ccon->is_eof_raw_ = 1;
+      processx__readahead_pop(ccon);
+      if (err) {
+	error("Cannot read from processx connection: %s", strerror(err));
+      }
+      if (invalid_tail) {
+	warning("Invalid multi-byte character at end of stream ignored");
+      }
+      break;
+    }
+    processx__readahead_pop(ccon);
+  }
+
+  if (ccon->is_eof_raw_ && ccon->utf8_data_size == 0) ccon->is_eof_ = 1;
+
+  return copied;
+}
+
 static ssize_t processx__connection_read(processx_connection_t *ccon) {
   ssize_t todo, bytes_read;
 
+  if (processx__connection_throttled(ccon)) return 0;
+
+  if (ccon->readahead) {
+    if (!processx__readahead_detached(ccon)) {
+      return processx__connection_read_ahead(ccon);
+    }
+    /* The I/O thread has failed, we read the pipe from now on, after
+       the partial character that the thread has read already */
+    if (!ccon->buffer) processx__connection_alloc(ccon);
+    ccon->buffer_data_size +=
+      processx__readahead_carry(ccon, ccon->buffer + ccon->buffer_data_size);
+    processx__readahead_remove(ccon);
+  }
+
   /* Nothing to read, nothing to convert to UTF8 */
   if (ccon->is_eof_raw_ && ccon->buffer_data_size == 0) {
     if (ccon->utf8_data_size == 0) ccon->is_eof_ = 1;
@@ -884,7 +1431,18 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
   if (todo == 0) return processx__connection_to_utf8(ccon);
 
   /* Otherwise we read */
-  bytes_read = read(ccon->handle, ccon->buffer + ccon->buffer_data_size, todo);
+  if (ccon->type == PROCESSX_FILE_TYPE_SHMRING) {
+    bytes_read = processx__shm_read(ccon, ccon->buffer +
+				    ccon->buffer_data_size, todo);
+  } else if (ccon->type == PROCESSX_FILE_TYPE_FILE) {
+    bytes_read = processx__file_read(ccon, ccon->buffer +
+				     ccon->buffer_data_size, todo);
+  } else {
+    bytes_read = read(ccon->handle, ccon->buffer + ccon->buffer_data_size,
+		      todo);
+  }
+  PROCESSX__STAT_ADD(ccon, read_calls, 1);
+  PROCESSX_TRACE3(read, ccon->handle, todo, bytes_read);
 
   if (bytes_read == 0) {
     /* EOF */
@@ -895,6 +1453,7 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
 
   } else if (bytes_read == -1 && errno == EAGAIN) {
     /* There is still data to read, potentially */
+    PROCESSX__STAT_ADD(ccon, eagain, 1);
     bytes_read = 0;
 
   } else if (bytes_read == -1) {
@@ -903,6 +1462,7 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
   }
 
   ccon->buffer_data_size += bytes_read;
+  PROCESSX__STAT_ADD(ccon, bytes_read, bytes_read);
 
   /* If there is anything to convert to UTF8, try converting */
   if (ccon->buffer_data_size > 0) {
@@ -938,6 +1498,7 @@ static ssize_t processx__connection_to_utf8(processx_connection_t *ccon) {
   while (!moved) {
     r = Riconv(ccon->iconv_ctx, &inbuf, &inbytesleft, &outbuf,
 	       &outbytesleft);
+    PROCESSX__STAT_ADD(ccon, iconv_calls, 1);
     moved = 1;
 
     if (r == (size_t) -1) {
@@ -969,6 +1530,7 @@ static ssize_t processx__connection_to_utf8(processx_connection_t *ccon) {
   outdone = outbuf - outbufold;
   if (outdone > 0 || indone > 0) {
     ccon->buffer_data_size -= indone;
+    PROCESSX__STAT_ADD(ccon, memmove_bytes, ccon->buffer_data_size);
     memmove(ccon->buffer, ccon->buffer + indone, ccon->buffer_data_size);
     ccon->utf8_data_size += outdone;
   }
@@ -1037,6 +1599,7 @@ int processx__interruptible_poll(struct pollfd fds[],
   while (timeout < 0 || timeleft > PROCESSX_INTERRUPT_INTERVAL) {
     do {
       ret = poll(fds, nfds, PROCESSX_INTERRUPT_INTERVAL);
+      processx__stats.poll_wakeups++;
     } while (ret == -1 && errno == EINTR);
 
     /* If not a timeout, then return */
@@ -1050,6 +1613,7 @@ int processx__interruptible_poll(struct pollfd fds[],
   if (timeleft >= 0) {
     do {
       ret = poll(fds, nfds, timeleft);
+      processx__stats.poll_wakeups++;
     } while (ret == -1 && errno == EINTR);
   }
 
@@ -11,6 +11,8 @@
 #include <unistd.h>
 #endif
 
+#include <stdint.h>
+
 /* --------------------------------------------------------------------- */
 /* Data types                                                            */
 /* --------------------------------------------------------------------- */
@@ -32,9 +34,24 @@ typedef enum {
   PROCESSX_FILE_TYPE_FILE = 1,	/* regular file, blocking IO */
   PROCESSX_FILE_TYPE_ASYNCFILE,	/* regular file, async IO (well, win only) */
   PROCESSX_FILE_TYPE_PIPE,	/* pipe, blocking IO */
-  PROCESSX_FILE_TYPE_ASYNCPIPE	/* pipe, async IO */
+  PROCESSX_FILE_TYPE_ASYNCPIPE,	/* pipe, async IO */
+  PROCESSX_FILE_TYPE_SHMRING	/* shared memory ring, Linux only */
 } processx_file_type_t;
 
+/* Counters, always on, see `processx_stats()` in R. They are also
+   summed over all connections, in `processx__stats`. */
+
+typedef struct {
+  uint64_t bytes_read;		/* bytes read from the data source */
+  uint64_t read_calls;		/* reads from the data source */
+  uint64_t eagain;		/* reads that had nothing to return */
+  uint64_t iconv_calls;
+  uint64_t memmove_bytes;	/* bytes moved within the buffers */
+  uint64_t buffer_growths;	/* reallocations of the UTF-8 buffer */
+  uint64_t peak_buffer_size;	/* largest size of the UTF-8 buffer */
+  uint64_t throttles;		/* times the buffer limit was reached */
+} processx_connection_stats_t;
+
 typedef struct processx_connection_s {
   processx_file_type_t type;
 
@@ -55,6 +72,32 @@ typedef struct processx_connection_s {
   size_t utf8_allocated_size;
   size_t utf8_data_size;
 
+  /* Backpressure: we stop reading the data source if the UTF-8 buffer
+     has `buffer_high` bytes, until it goes below `buffer_low`. */
+  size_t buffer_high;		/* 0 if no limit */
+  size_t buffer_low;
+  int throttled;
+  int split_lines;		/* deliver longer lines in pieces */
+  int split_pending;		/* returned a piece, the rest of the line follows */
+
+#ifndef _WIN32
+  void *shm;			/* for PROCESSX_FILE_TYPE_SHMRING */
+  size_t shm_map_size;
+
+  /* For PROCESSX_FILE_TYPE_FILE. `handle` is the file itself. */
+  int file_done_fd;		/* EOF here if the writers are done, or -1 */
+  int file_done;
+  int file_notify_fd;		/* inotify, Linux only */
+  int file_poll_fd;		/* fd to poll for new data */
+  off_t file_offset;
+  char *file_map;
+  size_t file_map_size;
+
+  void *readahead;		/* read by the I/O thread, or NULL */
+#endif
+
+  processx_connection_stats_t stats;
+
 } processx_connection_t;
 
 /* Generic poll method
@@ -111,6 +154,10 @@ SEXP processx_connection_read_chars(SEXP con, SEXP nchars);
 /* Read lines of characters from the connection. */
 SEXP processx_connection_read_lines(SEXP con, SEXP nlines);
 
+/* Read everything until EOF, as a single string, or as lines. */
+SEXP processx_connection_read_all(SEXP con);
+SEXP processx_connection_read_all_lines(SEXP con);
+
 /* Check if the connection has ended. */
 SEXP processx_connection_is_eof(SEXP con);
 
@@ -118,9 +165,22 @@ SEXP processx_connection_is_eof(SEXP con);
 SEXP processx_connection_close(SEXP con);
 SEXP processx_is_closed(SEXP con);
 
+/* Read raw bytes, without re-encoding. */
+SEXP processx_connection_read_raw(SEXP con, SEXP nbytes);
+
+/* Write raw bytes, without blocking. */
+SEXP processx_connection_write_bytes(SEXP con, SEXP bytes);
+
 /* Poll connections and other pollable handles */
 SEXP processx_connection_poll(SEXP pollables, SEXP timeout);
 
+/* Counters of a connection */
+SEXP processx_connection_stats(SEXP con);
+
+/* Set the buffer limit, see `buffer_limit` in `process$new()` */
+SEXP processx_connection_set_buffer_limit(SEXP con, SEXP high, SEXP low,
+					  SEXP split_lines);
+
 /* --------------------------------------------------------------------- */
 /* API from C                                                            */
 /* --------------------------------------------------------------------- */
@@ -141,6 +201,29 @@ ssize_t processx_c_connection_read_chars(
   void *buffer,
   size_t nbyte);
 
+/* Read raw bytes, no re-encoding */
+ssize_t processx_c_connection_read_bytes(
+  processx_connection_t *con,
+  void *buffer,
+  size_t nbyte);
+
+/* Write raw bytes, without blocking */
+ssize_t processx_c_connection_write_bytes(
+  processx_connection_t *con,
+  const void *buffer,
+  size_t nbyte);
+
+/* Zero-copy access to shared memory connections. `peek` returns the
+   readable contiguous part of the ring, `consume` marks `nbyte` bytes
+   of it as read. */
+int processx_c_connection_shm_peek(
+  processx_connection_t *con,
+  const char **ptr,
+  size_t *nbyte);
+void processx_c_connection_shm_consume(
+  processx_connection_t *con,
+  size_t nbyte);
+
 /* Read lines of characters */
 ssize_t processx_c_connection_read_line(
   processx_connection_t *ccon,
@@ -0,0 +1,86 @@
+
+#ifndef PROCESSX_SHM_H
+#define PROCESSX_SHM_H
+
+/* Shared memory output channel
+ *
+ * This file defines the layout of the shared memory ring buffer that
+ * processx can hand to a child process, and the functions that the
+ * child (the writer) needs. It does not depend on R, so cooperating
+ * programs (e.g. `tools/px.c`) can include it directly.
+ *
+ * The child gets two file descriptors, and their numbers are in the
+ * `PROCESSX_SHM` environment variable, as `<memfd>,<eventfd>`:
+ * - `memfd` is the shared memory, a `processx_shm_header_t` header,
+ *   followed by the data area. The size of the data area is in the
+ *   header.
+ * - `eventfd` is written by the child after new data was added to the
+ *   ring. processx polls it to wake up.
+ *
+ * There is a single writer and a single reader. `head` and `tail` are
+ * running byte counters, they are never wrapped, so `head - tail` is
+ * always the number of bytes in the buffer. The writer only updates
+ * `head` and `closed`, the reader only updates `tail`.
+ *
+ * If the ring is full, the writer has to wait for the reader. The
+ * reader does not notify the writer currently, so the writer needs to
+ * sleep a bit and try again.
+ *
+ * The channel ends when the writer sets `closed`, or when the child
+ * process exits.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROCESSX_SHM_MAGIC   0x68737870	/* "pxsh" */
+#define PROCESSX_SHM_VERSION 1
+#define PROCESSX_SHM_ENVVAR  "PROCESSX_SHM"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;		/* size of the data area */
+  uint64_t head;		/* total number of bytes written */
+  uint64_t tail;		/* total number of bytes read */
+  uint32_t closed;		/* no more data will be written */
+  uint32_t pad;
+  uint64_t reserved[3];		/* header is 64 bytes */
+} processx_shm_header_t;
+
+#define PROCESSX_SHM_DATA(hdr) \
+  ((char*) (hdr) + sizeof(processx_shm_header_t))
+
+/* Number of bytes the writer can add now */
+
+static inline uint64_t processx_shm_space(processx_shm_header_t *hdr) {
+  uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+  return hdr->size - (hdr->head - tail);
+}
+
+/* Add at most `nbyte` bytes to the ring, returns the number of bytes
+   added. This does not notify the reader, write a 64 bit integer to the
+   eventfd after this. */
+
+static inline size_t processx_shm_write(processx_shm_header_t *hdr,
+					const void *buf, size_t nbyte) {
+  uint64_t space = processx_shm_space(hdr);
+  uint64_t head = hdr->head;
+  size_t pos = head % hdr->size, first;
+  char *data = PROCESSX_SHM_DATA(hdr);
+
+  if (nbyte > space) nbyte = space;
+  first = hdr->size - pos;
+  if (first > nbyte) first = nbyte;
+  memcpy(data + pos, buf, first);
+  memcpy(data, (const char*) buf + first, nbyte - first);
+
+  __atomic_store_n(&hdr->head, head + nbyte, __ATOMIC_RELEASE);
+  return nbyte;
+}
+
+static inline void processx_shm_close(processx_shm_header_t *hdr) {
+  __atomic_store_n(&hdr->closed, 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,54 @@
+
+#ifndef PROCESSX_TRACE_H
+#define PROCESSX_TRACE_H
+
+/* Static tracing probes (USDT)
+ *
+ * If processx is installed with `--configure-args=--enable-usdt`, and
+ * `sys/sdt.h` (systemtap) is available, then these macros define static
+ * probes in the `processx` provider. Otherwise they expand to nothing,
+ * and the probe arguments are not evaluated, so they cost nothing.
+ *
+ * Probes and their arguments:
+ *
+ *   exec__start   command (char*)
+ *   exec__end     pid, errno of exec (0 on success, or if async), elapsed ns
+ *   read          fd, bytes requested, bytes read (-1: error or EAGAIN)
+ *   poll__enter   number of pollables, timeout in ms
+ *   poll__exit    number of pollables, number of ready ones, elapsed ns
+ *   sigchld       SIGCHLD signals and wait4() calls so far, in total
+ *   reap          pid, wait status (from the SIGCHLD handler)
+ *   kill          pid, whether the process was killed
+ *
+ * E.g. with bpftrace:
+ *
+ *   bpftrace -e 'usdt:/path/to/processx.so:processx:read
+ *     { @bytes[arg0] = sum(arg2); }'
+ *
+ * Times are measured only if the probes are compiled in.
+ */
+
+#ifdef PROCESSX_USDT
+
+#include <sys/sdt.h>
+#include <stdint.h>
+
+#define PROCESSX_TRACE_CLOCK(var) double var = processx__now()
+#define PROCESSX_TRACE_NS(var) ((int64_t) ((processx__now() - (var)) * 1e9))
+
+#define PROCESSX_TRACE1(name, a) DTRACE_PROBE1(processx, name, a)
+#define PROCESSX_TRACE2(name, a, b) DTRACE_PROBE2(processx, name, a, b)
+#define PROCESSX_TRACE3(name, a, b, c) DTRACE_PROBE3(processx, name, a, b, c)
+
+#else
+
+#define PROCESSX_TRACE_CLOCK(var)
+#define PROCESSX_TRACE_NS(var)
+
+#define PROCESSX_TRACE1(name, a) do { } while (0)
+#define PROCESSX_TRACE2(name, a, b) do { } while (0)
+#define PROCESSX_TRACE3(name, a, b, c) do { } while (0)
+
+#endif
+
+#endif
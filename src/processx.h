@@ -21,7 +21,9 @@ extern "C" {
 #endif
 
 #include <Rinternals.h>
+#include <R_ext/Rdynload.h>
 #include "processx-connection.h"
+#include "processx-trace.h"
 
 #ifdef _WIN32
 #include "win/processx-win.h"
@@ -34,15 +36,37 @@ extern "C" {
 SEXP processx_exec(SEXP command, SEXP args, SEXP std_out, SEXP std_err,
 		   SEXP windows_verbatim_args,
 		   SEXP windows_hide_window, SEXP private_, SEXP cleanup,
-		   SEXP encoding);
+		   SEXP encoding, SEXP options);
 SEXP processx_wait(SEXP status, SEXP timeout);
+SEXP processx_wait_many(SEXP statuses, SEXP timeout, SEXP all);
 SEXP processx_is_alive(SEXP status);
 SEXP processx_get_exit_status(SEXP status);
 SEXP processx_signal(SEXP status, SEXP signal);
 SEXP processx_kill(SEXP status, SEXP grace);
+SEXP processx_kill_many(SEXP statuses, SEXP grace);
 SEXP processx_get_pid(SEXP status);
+SEXP processx_is_alive_many(SEXP statuses);
+SEXP processx_exit_status_many(SEXP statuses);
+SEXP processx_pids_many(SEXP statuses);
+SEXP processx_get_resource_usage(SEXP status);
+SEXP processx_file_connection(SEXP status, SEXP which, SEXP path,
+			      SEXP encoding);
+SEXP processx_get_start_status(SEXP status);
 
 SEXP processx_poll(SEXP statuses, SEXP ms);
+SEXP processx_set_deadline(SEXP status, SEXP timeout, SEXP grace);
+SEXP processx_get_deadline(SEXP status);
+
+SEXP processx_stats();
+
+SEXP processx_capture_new(SEXP head, SEXP tail, SEXP tail_lines);
+SEXP processx_capture_add(SEXP xcap, SEXP text);
+SEXP processx_capture_get(SEXP xcap);
+
+SEXP processx_bench_clock();
+SEXP processx_bench_drain(SEXP con);
+SEXP processx_bench_poll(SEXP statuses, SEXP reps);
+SEXP processx_bench_is_alive(SEXP statuses, SEXP reps);
 
 SEXP processx__process_exists(SEXP pid);
 SEXP processx__disconnect_process_handle(SEXP status);
@@ -54,6 +78,42 @@ SEXP processx_write_named_pipe(SEXP pipe_ext, SEXP text);
 
 /* Common declarations */
 
+/* Global counters, always on, see `processx_stats()` in R. The SIGCHLD
+   handler only updates the `sigchld` fields. */
+
+typedef struct {
+  uint64_t spawns;
+  double spawn_time;		/* total time in processx_exec, seconds */
+  uint64_t sigchld;		/* SIGCHLD handler calls */
+  uint64_t sigchld_waits;	/* wait4() calls in the SIGCHLD handler */
+  uint64_t orphans;		/* adopted descendants reaped, subreaper mode */
+  uint64_t poll_calls;		/* processx_c_connection_poll() calls */
+  uint64_t poll_wakeups;	/* poll() / wait system calls that returned */
+  processx_connection_stats_t connections;
+} processx_stats_t;
+
+extern processx_stats_t processx__stats;
+
+/* Lazy character vector of the lines in a UTF-8 buffer, see altrep.c */
+void processx__init_altrep(DllInfo *dll);
+SEXP processx__lines_new(SEXP buf, size_t size);
+
+/* Monotonic clock, in seconds */
+double processx__now();
+
+/* Update a connection counter, and its global total */
+#define PROCESSX__STAT_ADD(ccon, field, n) do {			\
+    (ccon)->stats.field += (n);					\
+    processx__stats.connections.field += (n);			\
+  } while (0)
+
+#define PROCESSX__STAT_MAX(ccon, field, n) do {			\
+    if ((ccon)->stats.field < (n)) (ccon)->stats.field = (n);	\
+    if (processx__stats.connections.field < (n)) {		\
+      processx__stats.connections.field = (n);			\
+    }								\
+  } while (0)
+
 /* Interruption interval in ms */
 #define PROCESSX_INTERRUPT_INTERVAL 200
 
@@ -74,10 +134,55 @@ SEXP processx_write_named_pipe(SEXP pipe_ext, SEXP text);
 #define PXCLOSED  4		/* fd was already closed when started polling */
 #define PXSILENT  5		/* still open, but no data or EOF for now. No timeout, either */
                                 /* but there were events on other fds */
+#define PXSTARTED 6		/* async start: the process exec()-d */
+#define PXEXECFAILED 7		/* async start: exec() failed */
+
+/* Start state of a process, see the `async_start` option */
+
+#define PROCESSX_START_STARTED     0
+#define PROCESSX_START_STARTING    1
+#define PROCESSX_START_EXEC_FAILED 2
+
+/* Deadline of a process, see processx_set_deadline() */
+
+#define PROCESSX_DEADLINE_NONE  0
+#define PROCESSX_DEADLINE_ARMED 1	/* waiting for the deadline */
+#define PROCESSX_DEADLINE_TERM  2	/* SIGTERM sent, waiting for grace */
+#define PROCESSX_DEADLINE_DONE  3	/* killed, or exited */
+
+/* Resource limits that can be set for the child process, in the order
+   of the `limits` list in the spawn options. */
+
+#define PROCESSX_RLIMIT_ADDRESS_SPACE 0
+#define PROCESSX_RLIMIT_CPU_TIME      1
+#define PROCESSX_RLIMIT_OPEN_FILES    2
+#define PROCESSX_RLIMIT_CORE_SIZE     3
+#define PROCESSX_NUM_RLIMITS          4
 
 typedef struct {
   int windows_verbatim_args;
   int windows_hide;
+#ifndef _WIN32
+  int rlimit_set[PROCESSX_NUM_RLIMITS];
+  double rlimit[PROCESSX_NUM_RLIMITS]; /* R_PosInf means unlimited */
+  int nice_set;
+  int nice;
+  int ioprio_set;
+  int ioprio;			/* already encoded for ioprio_set() */
+  int *cpu_affinity;		/* CPU ids, or NULL */
+  int cpu_affinity_len;
+  size_t shm_size;		/* shared memory channel, 0 if none */
+  int shm_memfd;
+  int shm_eventfd;
+  char **shm_environ;
+  int file_done_fd;		/* inherited by the child, if output is a file */
+  int async_start;
+  size_t readahead;		/* memory cap of the I/O thread, 0 if off */
+  const char *spill_dir;	/* spill file directory of the I/O thread */
+  int stdin_pipe;
+  int subreaper;		/* Linux: PR_SET_PDEATHSIG in the child */
+  pid_t parent_pid;
+#endif
 } processx_options_t;
 
 #ifdef __cplusplus
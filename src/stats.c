@@ -0,0 +1,106 @@
+
+#include "processx.h"
+
+#ifndef _WIN32
+#include <time.h>
+#include <sys/time.h>
+#endif
+
+/* Internal counters
+ *
+ * These are always on, and cheap: a couple of additions per system call.
+ * Connection counters are kept per connection, and summed over all
+ * connections in `processx__stats.connections`. The peak buffer size
+ * total is the largest buffer of all connections.
+ */
+
+processx_stats_t processx__stats = { 0 };
+
+double processx__now() {
+#ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double) count.QuadPart / (double) freq.QuadPart;
+#else
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  if (!clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+#endif
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+  }
+#endif
+}
+
+static const char *processx__connection_stats_names[] = {
+  "bytes_read", "read_calls", "eagain", "iconv_calls", "memmove_bytes",
+  "buffer_growths", "peak_buffer_size", "throttles", "" };
+
+static void processx__connection_stats_fill(
+  double *out, const processx_connection_stats_t *stats) {
+  out[0] = stats->bytes_read;
+  out[1] = stats->read_calls;
+  out[2] = stats->eagain;
+  out[3] = stats->iconv_calls;
+  out[4] = stats->memmove_bytes;
+  out[5] = stats->buffer_growths;
+  out[6] = stats->peak_buffer_size;
+  out[7] = stats->throttles;
+}
+
+SEXP processx_connection_stats(SEXP con) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  SEXP result;
+
+  if (!ccon) error("Invalid connection object");
+
+  result = PROTECT(mkNamed(REALSXP, processx__connection_stats_names));
+  processx__connection_stats_fill(REAL(result), &ccon->stats);
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* The global counters, and the connection totals, in a list */
+
+SEXP processx_stats() {
+  const char *names[] = { "spawns", "spawn_time", "sigchld",
+			  "sigchld_waits", "orphans", "poll_calls",
+			  "poll_wakeups", "" };
+  const char *resnames[] = { "global", "connections", "" };
+  processx_stats_t stats;
+  SEXP result, global, connections;
+
+  /* Take a copy first, the SIGCHLD handler might update it */
+#ifndef _WIN32
+  processx__block_sigchld();
+#endif
+  stats = processx__stats;
+#ifndef _WIN32
+  processx__unblock_sigchld();
+#endif
+
+  result = PROTECT(mkNamed(VECSXP, resnames));
+
+  global = PROTECT(mkNamed(REALSXP, names));
+  REAL(global)[0] = stats.spawns;
+  REAL(global)[1] = stats.spawn_time;
+  REAL(global)[2] = stats.sigchld;
+  REAL(global)[3] = stats.sigchld_waits;
+  REAL(global)[4] = stats.orphans;
+  REAL(global)[5] = stats.poll_calls;
+  REAL(global)[6] = stats.poll_wakeups;
+  SET_VECTOR_ELT(result, 0, global);
+
+  connections = PROTECT(mkNamed(REALSXP, processx__connection_stats_names));
+  processx__connection_stats_fill(REAL(connections), &stats.connections);
+  SET_VECTOR_ELT(result, 1, connections);
+
+  UNPROTECT(3);
+  return result;
+}
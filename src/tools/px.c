@@ -4,6 +4,20 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include "../processx-shm.h"
+#endif
 
 void usage() {
   fprintf(stderr, "Usage: px [command arg] [command arg] ...\n\n");
@@ -21,8 +35,95 @@ void usage() {
 	  "print file to stdout\n");
   fprintf(stderr, "            return <exitcode> -- "
 	  "return with exitcode\n");
+  fprintf(stderr, "            shm    <string>   -- "
+	  "write string to the shared memory channel\n");
+  fprintf(stderr, "            shmln  <string>   -- "
+	  "same, add newline\n");
+  fprintf(stderr, "            outbytes <n>      -- "
+	  "print n bytes to stdout, in 64 byte lines\n");
+  fprintf(stderr, "            outlines <n>      -- "
+	  "print n lines to stdout, 64 bytes each\n");
+  fprintf(stderr, "            outbinary <n>     -- "
+	  "print n bytes of binary data to stdout\n");
+  fprintf(stderr, "            outrandom <n>     -- "
+	  "print n bytes of random UTF-8 to stdout\n");
+  fprintf(stderr, "            outinvalid <n>    -- "
+	  "print n bytes of invalid UTF-8 to stdout\n");
+  fprintf(stderr, "            interleave <n>    -- "
+	  "print n lines, alternating stdout and stderr\n");
+  fprintf(stderr, "            rate   <bytes/s>  -- "
+	  "limit the rate of the generated output, 0: no limit\n");
+  fprintf(stderr, "            seed   <seed>     -- "
+	  "seed for outrandom and outinvalid\n");
+  fprintf(stderr, "            consume <bytes/s> -- "
+	  "read stdin at a rate, print #bytes, 0: no limit\n");
+  fprintf(stderr, "            echo   <bytes>    -- "
+	  "copy stdin to stdout, exit after #bytes, 0: no limit\n");
+  fprintf(stderr, "            forktree <k>      -- "
+	  "create k descendants, that sleep 60 seconds\n");
+  fprintf(stderr, "            signal <signo>    -- "
+	  "exit with a signal\n");
+  fprintf(stderr, "            clock  0          -- "
+	  "print the monotonic clock, in seconds\n");
+}
+
+#ifdef __linux__
+
+/* Writer side of the processx shared memory channel */
+
+processx_shm_header_t *shm_hdr = 0;
+int shm_eventfd = -1;
+
+void shm_open_channel() {
+  int memfd;
+  size_t size;
+  const char *env = getenv(PROCESSX_SHM_ENVVAR);
+
+  if (!env || sscanf(env, "%d,%d", &memfd, &shm_eventfd) != 2) {
+    fprintf(stderr, "No processx shared memory channel\n");
+    exit(7);
+  }
+
+  shm_hdr = mmap(0, sizeof(processx_shm_header_t), PROT_READ,
+		 MAP_SHARED, memfd, 0);
+  if (shm_hdr == MAP_FAILED || shm_hdr->magic != PROCESSX_SHM_MAGIC) {
+    fprintf(stderr, "Invalid processx shared memory channel\n");
+    exit(7);
+  }
+  size = sizeof(processx_shm_header_t) + shm_hdr->size;
+  munmap(shm_hdr, sizeof(processx_shm_header_t));
+
+  shm_hdr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (shm_hdr == MAP_FAILED) {
+    fprintf(stderr, "Cannot map processx shared memory channel\n");
+    exit(7);
+  }
+}
+
+void shm_write(const char *buf, size_t nbyte) {
+  uint64_t one = 1;
+  if (!shm_hdr) shm_open_channel();
+  while (nbyte > 0) {
+    size_t n = processx_shm_write(shm_hdr, buf, nbyte);
+    if (n == 0) { usleep(1000); continue; }
+    if (write(shm_eventfd, &one, sizeof(one)) != sizeof(one)) {
+      fprintf(stderr, "Cannot notify processx\n");
+      exit(7);
+    }
+    buf += n;
+    nbyte -= n;
+  }
 }
 
+#else
+
+void shm_write(const char *buf, size_t nbyte) {
+  fprintf(stderr, "Shared memory channels are only supported on Linux\n");
+  exit(7);
+}
+
+#endif
+
 void cat2(int f, const char *s) {
   char buf[8192];
   long n;
@@ -49,6 +150,359 @@ void cat(const char* filename) {
   close(f);
 }
 
+/* Same clock as in processx, so the parent can compare them */
+
+double monotonic_clock() {
+#ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double) count.QuadPart / (double) freq.QuadPart;
+#else
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  if (!clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+#endif
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+  }
+#endif
+}
+
+/* Load generators for the benchmarks and stress tests
+ *
+ * All generated output goes through `load_write()`, which obeys the
+ * rate set by the `rate` command. The random generators use their own
+ * generator, so their output only depends on the `seed` command, and it
+ * is the same on all platforms.
+ */
+
+#define LINE_LENGTH 64
+
+/* Rate limiting, bytes per second. Zero means no limit. We write (or
+   read) in small chunks, and sleep if we are ahead of the schedule. */
+
+typedef struct {
+  double rate;
+  double start;
+  double bytes;
+} limiter_t;
+
+limiter_t out_limit = { 0, 0, 0 };
+
+void limiter_init(limiter_t *lim, double rate) {
+  lim->rate = rate;
+  lim->start = monotonic_clock();
+  lim->bytes = 0;
+}
+
+/* Wait until the next chunk is due, and return its maximum size. */
+
+size_t limiter_wait(limiter_t *lim, size_t n) {
+  double due, now, chunk;
+  if (lim->rate <= 0) return n;
+
+  due = lim->start + lim->bytes / lim->rate;
+  now = monotonic_clock();
+  if (due > now) usleep((due - now) * 1000.0 * 1000.0);
+
+  /* About 100 chunks per second */
+  chunk = lim->rate / 100;
+  if (chunk < 1) chunk = 1;
+  return n < chunk ? n : (size_t) chunk;
+}
+
+void limiter_done(limiter_t *lim, size_t n) {
+  lim->bytes += n;
+}
+
+void load_write(int fd, const char *buf, size_t n) {
+  while (n > 0) {
+    size_t chunk = limiter_wait(&out_limit, n);
+    ssize_t ret = write(fd, buf, chunk);
+    if (ret <= 0) {
+      fprintf(stderr, "write error in px\n");
+      exit(6);
+    }
+    limiter_done(&out_limit, ret);
+    buf += ret;
+    n -= ret;
+  }
+}
+
+/* xorshift64* */
+
+uint64_t random_state = 42;
+
+void random_seed(uint64_t seed) {
+  random_state = seed ? seed : 42;
+}
+
+uint32_t random_next() {
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  return (random_state * 2685821657736338717ULL) >> 32;
+}
+
+/* Generated output is collected in a buffer and written in chunks. */
+
+char load_buf[64 * 1024];
+size_t load_size = 0;
+
+void load_flush(int fd) {
+  load_write(fd, load_buf, load_size);
+  load_size = 0;
+}
+
+void load_add(int fd, const char *bytes, size_t n) {
+  if (load_size + n > sizeof(load_buf)) load_flush(fd);
+  memcpy(load_buf + load_size, bytes, n);
+  load_size += n;
+}
+
+/* `n` bytes, in lines of 64 bytes, the last line might be partial */
+
+void outbytes(double n) {
+  char buf[64 * 1024];
+  size_t i;
+
+  for (i = 0; i < sizeof(buf); i++) {
+    buf[i] = (i + 1) % LINE_LENGTH ? 'x' : '\n';
+  }
+
+  while (n > 0) {
+    size_t chunk = n < sizeof(buf) ? (size_t) n : sizeof(buf);
+    load_write(1, buf, chunk);
+    n -= chunk;
+  }
+}
+
+void outlines(double n) {
+  outbytes(n * LINE_LENGTH);
+}
+
+/* `n` bytes of all byte values, including zero */
+
+void outbinary(double n) {
+  char c;
+  double i;
+  for (i = 0; i < n; i++) {
+    c = (char) ((unsigned long) i % 256);
+    load_add(1, &c, 1);
+  }
+  load_flush(1);
+}
+
+/* Encode a code point in UTF-8, returns the number of bytes */
+
+size_t utf8_encode(uint32_t cp, char *out) {
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    out[0] = 0xc0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  } else if (cp < 0x10000) {
+    out[0] = 0xe0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3f);
+    out[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  } else {
+    out[0] = 0xf0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+  }
+}
+
+/* `n` bytes of random, valid UTF-8, with 1-4 byte characters, and a
+   newline now and then. Characters are split between writes. */
+
+void outrandom(double n) {
+  char ch[4];
+  while (n > 0) {
+    uint32_t len = 1 + random_next() % 4, cp;
+    if (len > n) len = n;
+    switch (len) {
+    case 1:
+      cp = random_next() % 16 ? 0x20 + random_next() % 0x5f : '\n';
+      break;
+    case 2:
+      cp = 0x80 + random_next() % (0x800 - 0x80);
+      break;
+    case 3:
+      do {
+	cp = 0x800 + random_next() % (0x10000 - 0x800);
+      } while (cp >= 0xd800 && cp <= 0xdfff);
+      break;
+    default:
+      cp = 0x10000 + random_next() % (0x110000 - 0x10000);
+      break;
+    }
+    load_add(1, ch, utf8_encode(cp, ch));
+    n -= len;
+  }
+  load_flush(1);
+}
+
+/* `n` bytes of invalid UTF-8: ASCII mixed with stray continuation
+   bytes, bytes that never appear in UTF-8, and truncated sequences. */
+
+void outinvalid(double n) {
+  char ch[2];
+  while (n > 0) {
+    size_t len = 1;
+    switch (random_next() % 4) {
+    case 0:
+      ch[0] = 'a' + random_next() % 26;
+      break;
+    case 1:
+      ch[0] = 0x80 + random_next() % 0x40;
+      break;
+    case 2:
+      ch[0] = random_next() % 2 ? 0xc0 + random_next() % 2 :
+	0xf5 + random_next() % 11;
+      break;
+    default:
+      ch[0] = 0xe2;
+      ch[1] = 'x';
+      len = n < 2 ? 1 : 2;
+      break;
+    }
+    load_add(1, ch, len);
+    n -= len;
+  }
+  load_flush(1);
+}
+
+/* `n` lines, alternating between stdout and stderr, one write each */
+
+void interleave(double n) {
+  char line[64];
+  double i;
+  for (i = 1; i <= n; i++) {
+    int fd = (unsigned long) i % 2 ? 1 : 2;
+    int len = snprintf(line, sizeof(line), "%s %.0f\n",
+		       fd == 1 ? "out" : "err", i);
+    load_write(fd, line, len);
+  }
+}
+
+/* Read standard input until EOF, at most `rate` bytes per second, and
+   print the number of bytes read. */
+
+void consume(double rate) {
+  char buf[64 * 1024];
+  limiter_t lim;
+  double total = 0;
+
+  limiter_init(&lim, rate);
+  for (;;) {
+    size_t chunk = limiter_wait(&lim, sizeof(buf));
+    ssize_t ret = read(0, buf, chunk);
+    if (ret < 0) {
+      fprintf(stderr, "error reading stdin in px\n");
+      exit(6);
+    }
+    if (ret == 0) break;
+    limiter_done(&lim, ret);
+    total += ret;
+  }
+
+  printf("%.0f\n", total);
+  fflush(stdout);
+}
+
+/* Copy the standard input to the standard output, unbuffered, until
+   EOF, or until `limit` bytes were copied, if not zero. */
+
+void echo(double limit) {
+  char buf[64 * 1024];
+  double total = 0;
+
+  for (;;) {
+    size_t chunk = sizeof(buf);
+    ssize_t ret, done = 0;
+    if (limit > 0 && limit - total < chunk) chunk = limit - total;
+    ret = read(0, buf, chunk);
+    if (ret < 0) {
+      fprintf(stderr, "error reading stdin in px\n");
+      exit(6);
+    }
+    if (ret == 0) break;
+    while (done < ret) {
+      ssize_t w = write(1, buf + done, ret - done);
+      if (w < 0) {
+	fprintf(stderr, "error writing stdout in px\n");
+	exit(6);
+      }
+      done += w;
+    }
+    total += ret;
+    if (limit > 0 && total >= limit) break;
+  }
+}
+
+/* Create `k` descendants, in a binary tree. They all sleep for 60
+   seconds, and they inherit the standard output and error, so these are
+   not closed until they exit. The original process goes on with the
+   rest of the commands. */
+
+#ifdef _WIN32
+
+void forktree(int k) {
+  fprintf(stderr, "px forktree is not supported on Windows\n");
+  exit(7);
+}
+
+#else
+
+void forksubtree(int k) {
+  int i, sizes[2];
+  sizes[0] = k / 2 + k % 2;
+  sizes[1] = k / 2;
+  for (i = 0; i < 2; i++) {
+    pid_t pid;
+    if (sizes[i] == 0) continue;
+    pid = fork();
+    if (pid == -1) {
+      fprintf(stderr, "cannot fork in px forktree\n");
+      exit(7);
+    } else if (pid == 0) {
+      forksubtree(sizes[i] - 1);
+      sleep(60);
+      _exit(0);
+    }
+  }
+}
+
+void forktree(int k) {
+  fflush(stdout);
+  fflush(stderr);
+  forksubtree(k);
+}
+
+#endif
+
+/* Exit with a signal. The default action of the signal must be to
+   terminate the process, otherwise we exit with status 8. */
+
+void exit_signal(int signo) {
+  fflush(stdout);
+  fflush(stderr);
+  signal(signo, SIG_DFL);
+  raise(signo);
+  fprintf(stderr, "px was not terminated by signal %d\n", signo);
+  exit(8);
+}
+
 int main(int argc, const char **argv) {
 
   int num, idx, ret;
@@ -92,6 +546,66 @@ int main(int argc, const char **argv) {
     } else if (!strcmp("cat", cmd)) {
       cat(argv[++idx]);
 
+    } else if (!strcmp("shm", cmd)) {
+      shm_write(argv[idx + 1], strlen(argv[idx + 1]));
+      idx++;
+
+    } else if (!strcmp("shmln", cmd)) {
+      shm_write(argv[idx + 1], strlen(argv[idx + 1]));
+      shm_write("\n", 1);
+      idx++;
+
+    } else if (!strcmp("outbytes", cmd) || !strcmp("outlines", cmd) ||
+	       !strcmp("outbinary", cmd) || !strcmp("outrandom", cmd) ||
+	       !strcmp("outinvalid", cmd) || !strcmp("interleave", cmd) ||
+	       !strcmp("rate", cmd) || !strcmp("consume", cmd) ||
+	       !strcmp("echo", cmd)) {
+      ret = sscanf(argv[++idx], "%lf", &fnum);
+      if (ret != 1 || fnum < 0) {
+	fprintf(stderr, "Invalid number for px %s: '%s'\n", cmd, argv[idx]);
+	return 3;
+      }
+      fflush(stdout);
+      if (!strcmp("outbytes", cmd)) {
+	outbytes(fnum);
+      } else if (!strcmp("outlines", cmd)) {
+	outlines(fnum);
+      } else if (!strcmp("outbinary", cmd)) {
+	outbinary(fnum);
+      } else if (!strcmp("outrandom", cmd)) {
+	outrandom(fnum);
+      } else if (!strcmp("outinvalid", cmd)) {
+	outinvalid(fnum);
+      } else if (!strcmp("interleave", cmd)) {
+	interleave(fnum);
+      } else if (!strcmp("rate", cmd)) {
+	limiter_init(&out_limit, fnum);
+      } else if (!strcmp("echo", cmd)) {
+	echo(fnum);
+      } else {
+	consume(fnum);
+      }
+
+    } else if (!strcmp("seed", cmd) || !strcmp("forktree", cmd) ||
+	       !strcmp("signal", cmd)) {
+      ret = sscanf(argv[++idx], "%d", &num);
+      if (ret != 1 || num < 0) {
+	fprintf(stderr, "Invalid number for px %s: '%s'\n", cmd, argv[idx]);
+	return 3;
+      }
+      if (!strcmp("seed", cmd)) {
+	random_seed(num);
+      } else if (!strcmp("forktree", cmd)) {
+	forktree(num);
+      } else {
+	exit_signal(num);
+      }
+
+    } else if (!strcmp("clock", cmd)) {
+      idx++;
+      printf("%.9f\n", monotonic_clock());
+      fflush(stdout);
+
     } else if (!strcmp("return", cmd)) {
       ret = sscanf(argv[++idx], "%d", &num);
       if (ret != 1) {
@@ -1,9 +1,13 @@
 
 #include "../processx.h"
 
-processx__child_list_t child_list_head = { 0, 0, 0 };
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+processx__child_list_t child_list_head = { 0, 0, 0, 0, 0 };
 processx__child_list_t *child_list = &child_list_head;
-processx__child_list_t child_free_list_head = { 0, 0, 0 };
+processx__child_list_t child_free_list_head = { 0, 0, 0, 0, 0 };
 processx__child_list_t *child_free_list = &child_free_list_head;
 
 void processx__freelist_add(processx__child_list_t *ptr) {
@@ -24,24 +28,29 @@ void processx__freelist_free() {
   child_free_list->next = 0;
 }
 
+/* The SIGCHLD handler might walk the list at any time, so the new node
+   must be complete before it is linked in. */
+
 int processx__child_add(pid_t pid, SEXP status) {
   processx__child_list_t *child = calloc(1, sizeof(processx__child_list_t));
   if (!child) return 1;
   child->pid = pid;
   child->status = status;
   child->next = child_list->next;
-  child_list->next = child;
+  __atomic_store_n(&child_list->next, child, __ATOMIC_RELEASE);
   return 0;
 }
 
-/* This is actually not used currently. But it should work fine. */
-/* LCOV_EXCL_START */
+/* This is called on the main thread only. The SIGCHLD handler might
+   interrupt us anywhere, so we unlink the node with a single store, and
+   only reuse its `next` pointer after that. Until then the handler can
+   still step over it. */
 
-void processx__child_remove(pid_t pid) {
+void processx__child_remove(processx__child_list_t *child) {
   processx__child_list_t *prev = child_list, *ptr = child_list->next;
   while (ptr) {
-    if (ptr->pid == pid) {
-      prev->next = ptr->next;
+    if (ptr == child) {
+      __atomic_store_n(&prev->next, ptr->next, __ATOMIC_SEQ_CST);
       memset(ptr, 0, sizeof(*ptr));
       /* Defer freeing the memory, because malloc/free are typically not
 	 reentrant, and if we free in the SIGCHLD handler, that can cause
@@ -55,56 +64,224 @@ void processx__child_remove(pid_t pid) {
   }
 }
 
-/* This is actually not used currently. But it should work fine. */
+/* The child that belongs to a process handle, if it was not removed yet */
 
-processx__child_list_t *processx__child_find(pid_t pid) {
+processx__child_list_t *processx__child_find_status(SEXP status) {
   processx__child_list_t *ptr = child_list->next;
   while (ptr) {
-    if (ptr->pid == pid) return ptr;
+    if (ptr->status == status) return ptr;
     ptr = ptr->next;
   }
   return 0;
 }
 
-/* LCOV_EXCL_STOP */
+/* Kill all children, when the package is unloaded. We send a SIGKILL to
+   all of them first, and then reap them together, so this takes about
+   as long as the slowest child takes to die, not the sum. Children that
+   do not die before the deadline stay zombies, until R exits.
+
+   Each round reaps with waitpid(-1), until there is nothing to reap, so
+   the number of system calls does not depend on the number of pending
+   children. If other code in R has children, and they exit while we are
+   unloading, then we reap them as well, we just do not count them.
+   Between the rounds we wait on the pidfds of the pending children on
+   Linux, so we wake up when one of them exits, or at the deadline.
+   Without pidfds we sleep, starting with 1ms, and doubling it. */
+
+#define PROCESSX__KILLEM_ALL_DEADLINE 2.0
+#define PROCESSX__KILLEM_ALL_MAX_SLEEP 64
+
+typedef struct {
+  pid_t pid;
+  int fd;
+  int ready;
+} processx__pending_t;
+
+static int processx__pidfd_open(pid_t pid) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+static void processx__pending_remove(processx__pending_t *pending,
+				     int *npending, int i) {
+  if (pending[i].fd >= 0) close(pending[i].fd);
+  pending[i] = pending[--(*npending)];
+}
+
+/* Reap all exited children, returns the number of pending ones reaped */
+
+static int processx__killem_reap(processx__pending_t *pending,
+				 int *npending) {
+  int reaped = 0, wstat, i;
+  pid_t wp;
+
+  while (*npending > 0) {
+    do {
+      wp = waitpid(-1, &wstat, WNOHANG);
+    } while (wp == -1 && errno == EINTR);
+    if (wp == 0) break;
+
+    /* No children at all, so the pending ones are not ours any more */
+    if (wp == -1) {
+      while (*npending > 0) processx__pending_remove(pending, npending, 0);
+      break;
+    }
+
+    for (i = 0; i < *npending; i++) {
+      if (pending[i].pid == wp) {
+	processx__pending_remove(pending, npending, i);
+	reaped++;
+	break;
+      }
+    }
+  }
+
+  /* If a pidfd was ready, but we did not reap the child, then somebody
+     else did */
+  for (i = 0; i < *npending; ) {
+    if (pending[i].ready) {
+      processx__pending_remove(pending, npending, i);
+    } else {
+      i++;
+    }
+  }
+
+  return reaped;
+}
+
+/* Wait until a pending child exits, but at most `timeout` ms. Marks the
+   children with a ready pidfd. */
+
+static void processx__killem_wait(processx__pending_t *pending,
+				  int npending, struct pollfd *fds,
+				  int timeout, int *backoff) {
+  int i, j = 0, ret;
+
+  for (i = 0; i < npending; i++) {
+    if (pending[i].fd < 0) continue;
+    fds[j].fd = pending[i].fd;
+    fds[j].events = POLLIN;
+    fds[j].revents = 0;
+    j++;
+  }
+
+  /* Without a pidfd for all of them, we also need to wake up to reap */
+  if (j < npending) {
+    if (*backoff < timeout) timeout = *backoff;
+    if (*backoff < PROCESSX__KILLEM_ALL_MAX_SLEEP) *backoff *= 2;
+  }
+
+  do {
+    ret = poll(fds, j, timeout);
+  } while (ret == -1 && errno == EINTR);
+  if (ret <= 0) return;
+
+  for (i = 0, j = 0; i < npending; i++) {
+    if (pending[i].fd < 0) continue;
+    pending[i].ready = fds[j++].revents != 0;
+  }
+}
 
 SEXP processx__killem_all() {
-  processx__child_list_t *ptr = child_list->next;
-  int killed = 0;
+  processx__child_list_t *ptr;
+  int killed = 0, reaped = 0, npending = 0, backoff = 1, i;
+  double start = processx__now(), elapsed;
+  const char *names[] = { "killed", "reaped", "pending", "time", "" };
+  processx__pending_t *pending = NULL;
+  struct pollfd *fds = NULL;
+  SEXP result;
 
   processx__remove_sigchld();
+  processx__readahead_stop();
 
-  while (ptr) {
-    processx__child_list_t *next = ptr->next;
+  for (ptr = child_list->next; ptr; ptr = ptr->next) npending++;
+  if (npending > 0) {
+    pending = malloc(npending * sizeof(processx__pending_t));
+    fds = malloc(npending * sizeof(struct pollfd));
+    if (!pending || !fds) {
+      free(pending);
+      free(fds);
+      pending = NULL;
+    }
+  }
+  npending = 0;
+
+  /* Signal all of them */
+  for (ptr = child_list->next; ptr; ptr = ptr->next) {
     SEXP status = ptr->status;
+    /* Finalized processes have no handle, they were killed already */
     processx_handle_t *handle =
-      (processx_handle_t*) R_ExternalPtrAddr(status);
-    int wp, wstat;
+      status ? (processx_handle_t*) R_ExternalPtrAddr(status) : NULL;
+    int wait = 0;
 
+    if (ptr->reaped) continue;
     if (handle && handle->cleanup) {
-      int ret = kill(ptr->pid, SIGKILL);
-      do {
-	wp = waitpid(ptr->pid, &wstat, 0);
-      } while (wp == -1 && errno == EINTR);
-      if (ret == 0) killed++;
+      /* The child might have left its process group */
+      if (kill(-ptr->pid, SIGKILL) == 0 || kill(ptr->pid, SIGKILL) == 0) {
+	killed++;
+      }
+      wait = 1;
+    } else if (!status && ptr->killed) {
+      wait = 1;
+    }
+    if (wait && pending) {
+      int fd = processx__pidfd_open(ptr->pid);
+      /* Somebody reaped it already */
+      if (fd == -1 && errno == ESRCH) continue;
+      pending[npending].pid = ptr->pid;
+      pending[npending].fd = fd;
+      pending[npending].ready = 0;
+      npending++;
     }
+  }
+
+  /* Reap them, until the deadline */
+  while (1) {
+    int timeout;
+    reaped += processx__killem_reap(pending, &npending);
+    if (npending == 0) break;
+    timeout = (PROCESSX__KILLEM_ALL_DEADLINE -
+	       (processx__now() - start)) * 1000 + 1;
+    if (timeout <= 0) break;
+    processx__killem_wait(pending, npending, fds, timeout, &backoff);
+  }
+  for (i = 0; i < npending; i++) {
+    if (pending[i].fd >= 0) close(pending[i].fd);
+  }
+  free(pending);
+  free(fds);
 
-    R_ClearExternalPtr(status);
+  ptr = child_list->next;
+  while (ptr) {
+    processx__child_list_t *next = ptr->next;
+    if (ptr->status) R_ClearExternalPtr(ptr->status);
     /* The handle will be freed in the finalizer, otherwise there is
        a race condition here. */
-
     free(ptr);
-
     ptr = next;
   }
 
   child_list->next = 0;
   processx__freelist_free();
+  processx__exit_queue_reset();
 
+  elapsed = processx__now() - start;
   if (killed > 0) {
-    REprintf("Unloading processx shared library, killed %d processes\n",
-	     killed);
+    REprintf("Unloading processx shared library, killed %d processes, "
+	     "reaped %d in %.0f ms", killed, reaped, elapsed * 1000);
+    if (npending > 0) REprintf(", %d did not exit", npending);
+    REprintf("\n");
   }
 
-  return R_NilValue;
+  result = PROTECT(mkNamed(REALSXP, names));
+  REAL(result)[0] = killed;
+  REAL(result)[1] = reaped;
+  REAL(result)[2] = npending;
+  REAL(result)[3] = elapsed;
+
+  UNPROTECT(1);
+  return result;
 }
@@ -0,0 +1,237 @@
+
+#ifndef _WIN32
+
+#include "../processx.h"
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#endif
+
+/* Reading file-backed standard output and error
+ *
+ * If `stdout` or `stderr` is redirected to a file, then we can follow
+ * the file while the process is writing it. We map the file into memory,
+ * and read it incrementally, keeping an offset.
+ *
+ * Regular files are always readable for `poll()`, so we need other ways
+ * to find out when there is new data, and when the file is complete:
+ * - The child process inherits the write end of a pipe (the "done pipe"),
+ *   without knowing about it. When the child and all of its descendants
+ *   exit, the pipe is closed, just like a stdout pipe would be.
+ * - On Linux we watch the file with inotify. We put the inotify fd and
+ *   the done pipe into an epoll fd, and poll that. Elsewhere we only
+ *   poll the done pipe, so new data is only noticed when polling starts,
+ *   or when the process exits.
+ *
+ * If the file is truncated while we are reading it, we might crash with
+ * a SIGBUS, so don't do that.
+ */
+
+#define PROCESSX__FILE_MIN_MAP (64 * 1024)
+
+/* Drop the current mapping, if any */
+
+static void processx__file_unmap(processx_connection_t *ccon) {
+  if (ccon->file_map) munmap(ccon->file_map, ccon->file_map_size);
+  ccon->file_map = 0;
+  ccon->file_map_size = 0;
+}
+
+/* Make sure that the mapping covers the first `size` bytes. We map
+   more than that, the part after the end of the file is not accessed. */
+
+static int processx__file_map(processx_connection_t *ccon, size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t newsize = size * 2;
+  void *ptr;
+
+  if (size <= ccon->file_map_size) return 0;
+
+  if (newsize < PROCESSX__FILE_MIN_MAP) newsize = PROCESSX__FILE_MIN_MAP;
+  newsize = (newsize + page - 1) / page * page;
+
+  processx__file_unmap(ccon);
+  ptr = mmap(NULL, newsize, PROT_READ, MAP_SHARED, ccon->handle, 0);
+  if (ptr == MAP_FAILED) return -1;
+
+  ccon->file_map = ptr;
+  ccon->file_map_size = newsize;
+  return 0;
+}
+
+/* Whether all writers are gone. Once they are, they stay gone. */
+
+static int processx__file_writer_done(processx_connection_t *ccon) {
+  struct pollfd fd;
+  int ret;
+
+  if (ccon->file_done || ccon->file_done_fd < 0) return 1;
+
+  fd.fd = ccon->file_done_fd;
+  fd.events = POLLIN;
+  fd.revents = 0;
+  do {
+    ret = poll(&fd, 1, 0);
+  } while (ret == -1 && errno == EINTR);
+
+  if (ret == 1) ccon->file_done = 1;
+  return ccon->file_done;
+}
+
+static void processx__file_drain_notify(processx_connection_t *ccon) {
+#ifdef __linux__
+  char buf[4096];
+  ssize_t ret;
+  if (ccon->file_notify_fd < 0) return;
+  do {
+    ret = read(ccon->file_notify_fd, buf, sizeof(buf));
+  } while (ret > 0 || (ret == -1 && errno == EINTR));
+#endif
+}
+
+static off_t processx__file_size(processx_connection_t *ccon) {
+  struct stat st;
+  if (fstat(ccon->handle, &st)) {
+    error("Cannot read from processx file connection: %s", strerror(errno));
+  }
+  return st.st_size;
+}
+
+/* Whether a read would return something, data or EOF */
+
+int processx__file_ready(processx_connection_t *ccon) {
+  processx__file_drain_notify(ccon);
+  if (processx__file_size(ccon) > ccon->file_offset) return 1;
+  return processx__file_writer_done(ccon);
+}
+
+/* Same semantics as `read()` on a non-blocking fd */
+
+ssize_t processx__file_read(processx_connection_t *ccon, void *buf,
+			    size_t nbyte) {
+  off_t size;
+  size_t avail;
+
+  /* Drain first, so we don't miss an event after looking at the size */
+  processx__file_drain_notify(ccon);
+  size = processx__file_size(ccon);
+
+  if (size <= ccon->file_offset) {
+    if (!processx__file_writer_done(ccon)) {
+      errno = EAGAIN;
+      return -1;
+    }
+    /* The writers might have written some more before they finished */
+    size = processx__file_size(ccon);
+    if (size <= ccon->file_offset) return 0;
+  }
+
+  avail = size - ccon->file_offset;
+  if (avail > nbyte) avail = nbyte;
+
+  if (processx__file_map(ccon, size)) {
+    /* Cannot map, e.g. some special file system, read it then */
+    ssize_t ret;
+    do {
+      ret = pread(ccon->handle, buf, avail, ccon->file_offset);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (ret > 0) ccon->file_offset += ret;
+    return ret;
+  }
+
+  memcpy(buf, ccon->file_map + ccon->file_offset, avail);
+  ccon->file_offset += avail;
+  return avail;
+}
+
+void processx__file_close(processx_connection_t *ccon) {
+  processx__file_unmap(ccon);
+  if (ccon->file_poll_fd >= 0 && ccon->file_poll_fd != ccon->file_done_fd) {
+    close(ccon->file_poll_fd);
+  }
+  if (ccon->file_notify_fd >= 0) close(ccon->file_notify_fd);
+  if (ccon->file_done_fd >= 0) close(ccon->file_done_fd);
+  ccon->file_poll_fd = ccon->file_notify_fd = ccon->file_done_fd = -1;
+}
+
+/* `done_fd` is not taken over, we duplicate it. */
+
+processx_connection_t *processx__file_connection_create(
+  const char *path, int done_fd, const char *encoding, SEXP *r_connection) {
+
+  processx_connection_t *con;
+  int fd;
+
+  do {
+    fd = open(path, O_RDONLY);
+  } while (fd == -1 && errno == EINTR);
+  if (fd == -1) {
+    error("Cannot open output file `%s`: %s", path, strerror(errno));
+  }
+  processx__cloexec_fcntl(fd, 1);
+
+  con = processx_c_connection_create(fd, PROCESSX_FILE_TYPE_FILE, encoding,
+				     r_connection);
+
+  if (done_fd >= 0) {
+    con->file_done_fd = dup(done_fd);
+    if (con->file_done_fd == -1) {
+      error("Cannot create processx file connection: %s", strerror(errno));
+    }
+    processx__cloexec_fcntl(con->file_done_fd, 1);
+    con->file_poll_fd = con->file_done_fd;
+  }
+
+#ifdef __linux__
+  /* If inotify or epoll are not available, we just poll the done pipe */
+  con->file_notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (con->file_notify_fd >= 0 &&
+      inotify_add_watch(con->file_notify_fd, path,
+			IN_MODIFY | IN_CLOSE_WRITE) >= 0) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (epfd >= 0 &&
+	!epoll_ctl(epfd, EPOLL_CTL_ADD, con->file_notify_fd, &ev) &&
+	(con->file_done_fd < 0 ||
+	 !epoll_ctl(epfd, EPOLL_CTL_ADD, con->file_done_fd, &ev))) {
+      con->file_poll_fd = epfd;
+    } else if (epfd >= 0) {
+      close(epfd);
+    }
+  }
+#endif
+
+  return con;
+}
+
+SEXP processx_file_connection(SEXP status, SEXP which, SEXP path,
+			      SEXP encoding) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  int cwhich = INTEGER(which)[0];
+  const char *cpath = CHAR(STRING_ELT(path, 0));
+  const char *cencoding = CHAR(STRING_ELT(encoding, 0));
+  SEXP result;
+
+  if (!handle) error("Internal processx error, handle already removed");
+  if (cwhich != 1 && cwhich != 2) error("Invalid stream for processx");
+
+  /* With an async start the child might not have created the file yet */
+  processx__start_status(handle, /* block= */ 1);
+
+  handle->pipes[cwhich] = processx__file_connection_create(
+    cpath, handle->file_done_fd, cencoding, &result);
+
+  return result;
+}
+
+#endif
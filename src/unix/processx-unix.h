@@ -2,6 +2,11 @@
 #ifndef R_PROCESSX_UNIX_H
 #define R_PROCESSX_UNIX_H
 
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "../processx-shm.h"
+
 typedef struct processx_handle_s {
   int exitcode;
   int collected;	 /* Whether exit code was collected already */
@@ -9,15 +14,45 @@ typedef struct processx_handle_s {
   int fd0;			/* writeable */
   int fd1;			/* readable */
   int fd2;			/* readable */
-  int waitpipe[2];		/* use it for wait() with timeout */
   int cleanup;
   processx_connection_t *pipes[3];
+  struct rusage rusage;		/* resource usage, filled in at exit */
+  processx_connection_t *shm;	/* shared memory channel, or NULL */
+  processx_shm_header_t *shm_hdr;
+  size_t shm_map_size;
+  int shm_eventfd;
+  int file_done_fd;		/* closed when output files are complete */
+  int start_state;		/* PROCESSX_START_* */
+  int start_reported;		/* whether poll() reported the start */
+  int exec_fd;			/* exec status, for async start */
+  int exec_errno;
+  double deadline;		/* monotonic time, see processx_set_deadline() */
+  double deadline_grace;	/* SIGKILL this long after SIGTERM */
+  double killed_at;		/* when the deadline killed it, or 0 */
+  int deadline_state;		/* PROCESSX_DEADLINE_* */
 } processx_handle_t;
 
 char *processx__tmp_string(SEXP str, int i);
 char **processx__tmp_character(SEXP chr);
+SEXP processx__list_elt(SEXP list, const char *name);
 
 void processx__sigchld_callback(int sig, siginfo_t *info, void *ctx);
+int processx__reap_children();
+void processx__poll_children();
+int processx__drain_exits();
+void processx__check_sigchld();
+int processx__child_exited(SEXP status);
+pid_t processx__wait_child(SEXP status, int options);
+int processx__wait_handles(processx_handle_t **handles, int n, int all,
+			   int timeout);
+void processx__exit_queue_reset();
+void processx__subreaper_init();
+void processx__subreaper_add(pid_t pgid);
+extern int processx__notify_pipe[2];
+void processx__notify_init();
+void processx__notify_drain();
+int processx__poll_func_exits(void *object, int status, int *handle,
+			      int *again);
 void processx__setup_sigchld();
 void processx__remove_sigchld();
 void processx__block_sigchld();
@@ -30,17 +65,26 @@ SEXP processx__killem_all();
 
 typedef struct processx__child_list_s {
   pid_t pid;
-  SEXP status;
+  SEXP status;			/* NULL after the finalizer */
+  volatile sig_atomic_t reaped;	/* set by the SIGCHLD handler */
+  int killed;			/* killed by the finalizer */
   struct processx__child_list_s *next;
 } processx__child_list_t;
 
 int processx__child_add(pid_t pid, SEXP status);
-void processx__child_remove(pid_t pid);
-processx__child_list_t *processx__child_find(pid_t pid);
+void processx__child_remove(processx__child_list_t *child);
+processx__child_list_t *processx__child_find_status(SEXP status);
 void processx__freelist_add(processx__child_list_t *ptr);
 void processx__freelist_free();
 
-void processx__collect_exit_status(SEXP status, int wstat);
+void processx__collect_exit_status(SEXP status, int wstat,
+				   struct rusage *rusage);
+
+/* Async start */
+
+int processx__start_status(processx_handle_t *handle, int block);
+int processx__poll_func_start(void *object, int status, int *handle,
+			      int *again);
 
 int processx__nonblock_fcntl(int fd, int set);
 int processx__cloexec_fcntl(int fd, int set);
@@ -54,6 +98,60 @@ void processx__create_control_write(processx_handle_t *handle,
 				    int fd, const char *membername,
 				    SEXP privatex);
 
+/* Shared memory channel */
+
+int processx__shm_create(processx_handle_t *handle, size_t size);
+char **processx__shm_environ(int memfd, int eventfd);
+void processx__shm_create_connection(processx_handle_t *handle, int memfd,
+				     SEXP private, const char *encoding);
+void processx__shm_writer_exited(processx_handle_t *handle);
+void processx__shm_destroy(processx_handle_t *handle);
+
+int processx__shm_ready(processx_connection_t *ccon);
+int processx__shm_peek(processx_connection_t *ccon, const char **ptr,
+		       size_t *nbyte);
+void processx__shm_consume(processx_connection_t *ccon, size_t nbyte);
+ssize_t processx__shm_read(processx_connection_t *ccon, void *buf,
+			   size_t nbyte);
+void processx__shm_unmap(processx_connection_t *ccon);
+
+/* File-backed output */
+
+processx_connection_t *processx__file_connection_create(
+  const char *path, int done_fd, const char *encoding, SEXP *r_connection);
+int processx__file_ready(processx_connection_t *ccon);
+ssize_t processx__file_read(processx_connection_t *ccon, void *buf,
+			    size_t nbyte);
+void processx__file_close(processx_connection_t *ccon);
+
+/* Read-ahead I/O thread */
+
+typedef struct {
+  size_t size;			/* bytes of UTF-8 data */
+  int eof;			/* last chunk */
+  int invalid_tail;		/* incomplete character at EOF */
+  int err;			/* errno of a failed read, at EOF */
+  off_t spill_offset;		/* spill file data before this comes first */
+  size_t raw_bytes;		/* bytes read, for the statistics */
+  size_t reads;
+  size_t iconv_calls;
+  char data[];
+} processx__chunk_t;
+
+void processx__readahead_add(processx_connection_t *ccon, size_t cap,
+			     const char *spill_dir);
+void processx__readahead_remove(processx_connection_t *ccon);
+int processx__readahead_ready(processx_connection_t *ccon);
+int processx__readahead_detached(processx_connection_t *ccon);
+int processx__readahead_fd(processx_connection_t *ccon);
+size_t processx__readahead_carry(processx_connection_t *ccon, char *buf);
+processx__chunk_t *processx__readahead_peek(processx_connection_t *ccon);
+void processx__readahead_pop(processx_connection_t *ccon);
+int processx__readahead_spilled(processx_connection_t *ccon);
+ssize_t processx__readahead_spill_read(processx_connection_t *ccon,
+				       char *buf, size_t size);
+void processx__readahead_stop();
+
 /* Interruptible system calls */
 
 int processx__interruptible_poll(struct pollfd fds[],
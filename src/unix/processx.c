@@ -1,8 +1,23 @@
 
 #ifndef _WIN32
 
+/* For sched_setaffinity() and CPU_SET() */
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include <limits.h>
+
 #include "../processx.h"
 
+#ifdef __linux__
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
+
 /* Internals */
 
 static void processx__child_init(processx_handle_t *handle, int pipes[3][2],
@@ -42,13 +57,19 @@ extern processx__child_list_t *child_free_list;
 void R_init_processx_unix() {
   child_list_head.pid = 0;
   child_list_head.status = 0;
+  child_list_head.reaped = 0;
+  child_list_head.killed = 0;
   child_list_head.next = 0;
   child_list = &child_list_head;
 
   child_free_list_head.pid = 0;
   child_free_list_head.status = 0;
+  child_free_list_head.reaped = 0;
+  child_free_list_head.killed = 0;
   child_free_list_head.next = 0;
   child_free_list = &child_free_list_head;
+
+  processx__exit_queue_reset();
 }
 
 /* These run in the child process, so no coverage here. */
@@ -59,6 +80,70 @@ void processx__write_int(int fd, int err) {
   (void) dummy;
 }
 
+/* Resource limits, priorities and CPU affinity. These are applied right
+   before exec(), because the limits (e.g. the open files limit) might
+   interfere with setting up the child. */
+
+static void processx__child_set_limits(processx_options_t *options,
+				       int error_fd) {
+  static const int resources[PROCESSX_NUM_RLIMITS] = {
+    RLIMIT_AS, RLIMIT_CPU, RLIMIT_NOFILE, RLIMIT_CORE };
+  int i;
+
+  for (i = 0; i < PROCESSX_NUM_RLIMITS; i++) {
+    struct rlimit rl;
+    if (!options->rlimit_set[i]) continue;
+    if (getrlimit(resources[i], &rl)) {
+      processx__write_int(error_fd, - errno); raise(SIGKILL);
+    }
+    if (options->rlimit[i] == R_PosInf) {
+      rl.rlim_cur = rl.rlim_max;
+    } else {
+      rl.rlim_cur = (rlim_t) options->rlimit[i];
+      /* Lower the hard limit as well, so the child cannot raise it */
+      if (rl.rlim_max == RLIM_INFINITY || rl.rlim_cur < rl.rlim_max) {
+	rl.rlim_max = rl.rlim_cur;
+      }
+    }
+    if (setrlimit(resources[i], &rl)) {
+      processx__write_int(error_fd, - errno); raise(SIGKILL);
+    }
+  }
+
+  if (options->nice_set) {
+    if (setpriority(PRIO_PROCESS, 0, options->nice)) {
+      processx__write_int(error_fd, - errno); raise(SIGKILL);
+    }
+  }
+
+#ifdef __linux__
+  if (options->ioprio_set) {
+    /* IOPRIO_WHO_PROCESS is 1, there is no glibc wrapper or header */
+    if (syscall(SYS_ioprio_set, 1, 0, options->ioprio)) {
+      processx__write_int(error_fd, - errno); raise(SIGKILL);
+    }
+  }
+
+  if (options->cpu_affinity) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (i = 0; i < options->cpu_affinity_len; i++) {
+      CPU_SET(options->cpu_affinity[i], &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+      processx__write_int(error_fd, - errno); raise(SIGKILL);
+    }
+  }
+#endif
+}
+
+/* File descriptors that are inherited by the child */
+
+static int processx__child_keep_fd(processx_options_t *options, int fd) {
+  return fd == options->shm_memfd || fd == options->shm_eventfd ||
+    fd == options->file_done_fd;
+}
+
 static void processx__child_init(processx_handle_t* handle, int pipes[3][2],
 				 char *command, char **args, int error_fd,
 				 const char *std_out, const char *std_err,
@@ -69,12 +154,26 @@ static void processx__child_init(processx_handle_t* handle, int pipes[3][2],
 
   setsid();
 
+#ifdef __linux__
+  /* Subreaper mode: die with R. If R died before the prctl() call, then
+     we were reparented already, and the signal never comes. */
+  if (options->subreaper) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != options->parent_pid) raise(SIGKILL);
+  }
+#endif
+
   /* The dup2 calls make sure that stdin, stdout and stderr use file
      descriptors 0, 1 and 3 respectively. */
 
-  /* stdin is coming from /dev/null */
+  /* stdin is coming from a pipe, or from /dev/null */
 
-  fd0 = open("/dev/null", O_RDONLY);
+  if (pipes[0][1] >= 0) {
+    fd0 = pipes[0][1];
+    close(pipes[0][0]);
+  } else {
+    fd0 = open("/dev/null", O_RDONLY);
+  }
   if (fd0 == -1) { processx__write_int(error_fd, - errno); raise(SIGKILL); }
 
   if (fd0 != 0) fd0 = dup2(fd0, 0);
@@ -115,12 +214,29 @@ static void processx__child_init(processx_handle_t* handle, int pipes[3][2],
   processx__nonblock_fcntl(fd2, 0);
 
   for (i = 3; i < error_fd; i++) {
+    if (processx__child_keep_fd(options, i)) continue;
     close(i);
   }
   for (i = error_fd + 1; ; i++) {
+    if (processx__child_keep_fd(options, i)) continue;
     if (-1 == close(i) && i > 200) break;
   }
 
+  /* This is closed when the child and its children are done */
+  if (options->file_done_fd >= 0) {
+    processx__cloexec_fcntl(options->file_done_fd, 0);
+  }
+
+  /* The shared memory channel is inherited, and it is in the environment */
+  if (options->shm_size) {
+    extern char **environ;
+    processx__cloexec_fcntl(options->shm_memfd, 0);
+    processx__cloexec_fcntl(options->shm_eventfd, 0);
+    environ = options->shm_environ;
+  }
+
+  processx__child_set_limits(options, error_fd);
+
   execvp(command, args);
   processx__write_int(error_fd, - errno);
   raise(SIGKILL);
@@ -135,37 +251,23 @@ SEXP processx__disconnect_process_handle(SEXP status) {
 
 void processx__finalizer(SEXP status) {
   processx_handle_t *handle = (processx_handle_t*) R_ExternalPtrAddr(status);
+  processx__child_list_t *child;
   pid_t pid;
-  int wp, wstat;
+  int killed = 0;
   SEXP private;
 
-  processx__block_sigchld();
-
-  /* Free child list nodes that are not needed any more. */
-  processx__freelist_free();
-
   /* Already freed? */
   if (!handle) goto cleanup;
 
   pid = handle->pid;
 
-  if (handle->cleanup) {
-    /* Do a non-blocking waitpid() to see if it is running */
-    do {
-      wp = waitpid(pid, &wstat, WNOHANG);
-    } while (wp == -1 && errno == EINTR);
-
-    /* Maybe just waited on it? Then collect status */
-    if (wp == pid) processx__collect_exit_status(status, wstat);
-
-    /* If it is running, we need to kill it, and wait for the exit status */
-    if (wp == 0) {
-      kill(-pid, SIGKILL);
-      do {
-	wp = waitpid(pid, &wstat, 0);
-      } while (wp == -1 && errno == EINTR);
-      processx__collect_exit_status(status, wstat);
-    }
+  /* If it is running, we kill it, but we do not wait for it. The child
+     stays in the child list, without a handle, see below, and the
+     SIGCHLD handler reaps it, like any other child, and the main thread
+     removes it from the list later. So a GC that collects many processes
+     does not wait for each of them to die. */
+  if (handle->cleanup && !processx__child_exited(status)) {
+    killed = kill(-pid, SIGKILL) == 0;
   }
 
   /* Copy over pid and exit status */
@@ -173,7 +275,8 @@ void processx__finalizer(SEXP status) {
   if (!isNull(private)) {
     SEXP sone = PROTECT(ScalarLogical(1));
     SEXP spid = PROTECT(ScalarInteger(pid));
-    SEXP sexitcode = PROTECT(ScalarInteger(handle->exitcode));
+    SEXP sexitcode = PROTECT(ScalarInteger(
+      handle->collected ? handle->exitcode : NA_INTEGER));
 
     defineVar(install("exited"), sone, private);
     defineVar(install("pid"), spid, private);
@@ -185,14 +288,26 @@ void processx__finalizer(SEXP status) {
 
   /* Note: if no cleanup is requested, then we still have a sigchld
      handler, to read out the exit code via waitpid, but no handle
-     any more. */
+     any more. The status object will be gone as well, so the child
+     list must not refer to it. */
+  child = processx__child_find_status(status);
+  if (child) {
+    child->killed = killed;
+    child->status = 0;
+  }
 
   /* Deallocate memory */
   R_ClearExternalPtr(status);
   processx__handle_destroy(handle);
 
  cleanup:
-  processx__unblock_sigchld();
+  /* Free child list nodes that are not needed any more. This is not a
+     race condition with the SIGCHLD handler, because we block it. */
+  if (child_free_list->next) {
+    processx__block_sigchld();
+    processx__freelist_free();
+    processx__unblock_sigchld();
+  }
 }
 
 static SEXP processx__make_handle(SEXP private, int cleanup) {
@@ -202,7 +317,9 @@ static SEXP processx__make_handle(SEXP private, int cleanup) {
   handle = (processx_handle_t*) malloc(sizeof(processx_handle_t));
   if (!handle) { error("Out of memory"); }
   memset(handle, 0, sizeof(processx_handle_t));
-  handle->waitpipe[0] = handle->waitpipe[1] = -1;
+  handle->shm_eventfd = -1;
+  handle->file_done_fd = -1;
+  handle->exec_fd = -1;
 
   result = PROTECT(R_MakeExternalPtr(handle, private, R_NilValue));
   R_RegisterCFinalizerEx(result, processx__finalizer, 1);
@@ -214,6 +331,9 @@ static SEXP processx__make_handle(SEXP private, int cleanup) {
 
 static void processx__handle_destroy(processx_handle_t *handle) {
   if (!handle) return;
+  processx__shm_destroy(handle);
+  if (handle->file_done_fd >= 0) close(handle->file_done_fd);
+  if (handle->exec_fd >= 0) close(handle->exec_fd);
   free(handle);
 }
 
@@ -245,10 +365,97 @@ skip:
   processx__cloexec_fcntl(pipe[1], 1);
 }
 
+/* Spawn options that are only used on Unix. Missing list elements are
+   ignored. See `process_initialize()` for how they are created. */
+
+static void processx__parse_options(SEXP options,
+				    processx_options_t *coptions) {
+  SEXP limits = processx__list_elt(options, "limits");
+  SEXP nice = processx__list_elt(options, "nice");
+  SEXP ioprio = processx__list_elt(options, "io_priority");
+  SEXP affinity = processx__list_elt(options, "cpu_affinity");
+  SEXP shm_size = processx__list_elt(options, "shm_size");
+  SEXP async_start = processx__list_elt(options, "async_start");
+  SEXP readahead = processx__list_elt(options, "readahead");
+  SEXP stdin_pipe = processx__list_elt(options, "stdin_pipe");
+  SEXP spill_dir = processx__list_elt(options, "spill_dir");
+  SEXP subreaper = processx__list_elt(options, "subreaper");
+  int i;
+
+  coptions->shm_memfd = coptions->shm_eventfd = -1;
+  coptions->file_done_fd = -1;
+
+  if (!isNull(limits)) {
+    if (LENGTH(limits) != PROCESSX_NUM_RLIMITS) {
+      error("Invalid resource limits for processx");
+    }
+    for (i = 0; i < PROCESSX_NUM_RLIMITS; i++) {
+      double lim = REAL(limits)[i];
+      coptions->rlimit_set[i] = !ISNA(lim);
+      coptions->rlimit[i] = lim;
+    }
+  }
+
+  if (!isNull(nice)) {
+    coptions->nice_set = 1;
+    coptions->nice = INTEGER(nice)[0];
+  }
+
+  if (!isNull(ioprio)) {
+#ifdef __linux__
+    /* class and level, this is IOPRIO_PRIO_VALUE() */
+    coptions->ioprio_set = 1;
+    coptions->ioprio = (INTEGER(ioprio)[0] << 13) | INTEGER(ioprio)[1];
+#else
+    error("Setting the I/O priority is only supported on Linux");
+#endif
+  }
+
+  if (!isNull(affinity)) {
+#ifdef __linux__
+    coptions->cpu_affinity_len = LENGTH(affinity);
+    coptions->cpu_affinity = INTEGER(affinity);
+    for (i = 0; i < coptions->cpu_affinity_len; i++) {
+      if (coptions->cpu_affinity[i] < 0 ||
+	  coptions->cpu_affinity[i] >= CPU_SETSIZE) {
+	error("Invalid CPU id in CPU affinity: %d", coptions->cpu_affinity[i]);
+      }
+    }
+#else
+    error("Setting the CPU affinity is only supported on Linux");
+#endif
+  }
+
+  if (!isNull(async_start)) coptions->async_start = LOGICAL(async_start)[0];
+
+  if (!isNull(shm_size)) {
+#ifdef __linux__
+    coptions->shm_size = (size_t) REAL(shm_size)[0];
+#else
+    error("Shared memory channels are only supported on Linux");
+#endif
+  }
+
+  if (!isNull(readahead)) coptions->readahead = (size_t) REAL(readahead)[0];
+  if (!isNull(stdin_pipe)) coptions->stdin_pipe = LOGICAL(stdin_pipe)[0];
+  if (!isNull(spill_dir)) {
+    coptions->spill_dir = CHAR(STRING_ELT(spill_dir, 0));
+  }
+
+  if (!isNull(subreaper) && LOGICAL(subreaper)[0]) {
+#ifdef __linux__
+    coptions->subreaper = 1;
+    coptions->parent_pid = getpid();
+#else
+    error("Subreaper mode is only supported on Linux");
+#endif
+  }
+}
+
 SEXP processx_exec(SEXP command, SEXP args, SEXP std_out, SEXP std_err,
 		   SEXP windows_verbatim_args,
 		   SEXP windows_hide_window, SEXP private, SEXP cleanup,
-		   SEXP encoding) {
+		   SEXP encoding, SEXP options) {
 
   char *ccommand = processx__tmp_string(command, 0);
   char **cargs = processx__tmp_character(args);
@@ -256,16 +463,23 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP std_out, SEXP std_err,
   const char *cstdout = isNull(std_out) ? 0 : CHAR(STRING_ELT(std_out, 0));
   const char *cstderr = isNull(std_err) ? 0 : CHAR(STRING_ELT(std_err, 0));
   const char *cencoding = CHAR(STRING_ELT(encoding, 0));
-  processx_options_t options = { 0 };
+  processx_options_t coptions = { 0 };
 
-  pid_t pid;
-  int err, exec_errorno = 0, status;
+  pid_t pid = -1;
+  int exec_errorno = 0;
   ssize_t r;
   int signal_pipe[2] = { -1, -1 };
   int pipes[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+  int done_pipe[2] = { -1, -1 };
 
   processx_handle_t *handle = NULL;
   SEXP result;
+  double start_time = processx__now();
+
+  processx__parse_options(options, &coptions);
+  if (coptions.subreaper) processx__subreaper_init();
+
+  PROCESSX_TRACE1(exec__start, ccommand);
 
   if (pipe(signal_pipe)) { goto cleanup; }
   processx__cloexec_fcntl(signal_pipe[0], 1);
@@ -276,19 +490,41 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP std_out, SEXP std_err,
   result = PROTECT(processx__make_handle(private, ccleanup));
   handle = R_ExternalPtrAddr(result);
 
-  /* Create pipes, if requested. TODO: stdin */
+  /* Create pipes, if requested */
+  if (coptions.stdin_pipe) processx__make_socketpair(pipes[0]);
   if (cstdout && !strcmp(cstdout, "|")) processx__make_socketpair(pipes[1]);
   if (cstderr && !strcmp(cstderr, "|")) processx__make_socketpair(pipes[2]);
 
+  /* If output goes to a file, we need to know when it is complete,
+     see unix/file.c */
+  if ((cstdout && strcmp(cstdout, "|")) || (cstderr && strcmp(cstderr, "|"))) {
+    if (pipe(done_pipe)) {
+      error("processx error: %s", strerror(errno));
+    }
+    processx__cloexec_fcntl(done_pipe[0], 1);
+    processx__cloexec_fcntl(done_pipe[1], 1);
+    coptions.file_done_fd = done_pipe[1];
+  }
+
+  /* Shared memory channel, if requested */
+  if (coptions.shm_size) {
+    coptions.shm_memfd = processx__shm_create(handle, coptions.shm_size);
+    coptions.shm_eventfd = handle->shm_eventfd;
+    coptions.shm_environ =
+      processx__shm_environ(coptions.shm_memfd, coptions.shm_eventfd);
+  }
+
   processx__block_sigchld();
 
   pid = fork();
 
   /* TODO: how could we test a failure? */
   if (pid == -1) {		/* ERROR */
-    err = -errno;
     if (signal_pipe[0] >= 0) close(signal_pipe[0]);
     if (signal_pipe[1] >= 0) close(signal_pipe[1]);
+    if (coptions.shm_memfd >= 0) close(coptions.shm_memfd);
+    if (done_pipe[0] >= 0) close(done_pipe[0]);
+    if (done_pipe[1] >= 0) close(done_pipe[1]);
     processx__unblock_sigchld();
     goto cleanup;
   }
@@ -297,50 +533,66 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP std_out, SEXP std_err,
   if (pid == 0) {
     /* LCOV_EXCL_START */
     processx__child_init(handle, pipes, ccommand, cargs, signal_pipe[1],
-			 cstdout, cstderr, &options);
+			 cstdout, cstderr, &coptions);
     goto cleanup;
     /* LCOV_EXCL_STOP */
   }
 
   /* We need to know the processx children */
   if (processx__child_add(pid, result)) {
-    err = -errno;
     if (signal_pipe[0] >= 0) close(signal_pipe[0]);
     if (signal_pipe[1] >= 0) close(signal_pipe[1]);
     processx__unblock_sigchld();
     goto cleanup;
   }
 
+  /* Its orphaned descendants are reparented to us, and we reap them */
+  if (coptions.subreaper) processx__subreaper_add(pid);
+
   /* SIGCHLD can arrive now */
+  handle->pid = pid;
   processx__unblock_sigchld();
 
   if (signal_pipe[1] >= 0) close(signal_pipe[1]);
 
-  do {
-    r = read(signal_pipe[0], &exec_errorno, sizeof(exec_errorno));
-  } while (r == -1 && errno == EINTR);
+  if (coptions.async_start) {
+    /* We'll read the exec status later, see processx__start_status() */
+    handle->exec_fd = signal_pipe[0];
+    processx__nonblock_fcntl(handle->exec_fd, 1);
+    handle->start_state = PROCESSX_START_STARTING;
 
-  if (r == 0) {
-    ; /* okay, EOF */
-  } else if (r == sizeof(exec_errorno)) {
+  } else {
     do {
-      err = waitpid(pid, &status, 0); /* okay, read errorno */
-    } while (err == -1 && errno == EINTR);
+      r = read(signal_pipe[0], &exec_errorno, sizeof(exec_errorno));
+    } while (r == -1 && errno == EINTR);
 
-  } else if (r == -1 && errno == EPIPE) {
-    do {
-      err = waitpid(pid, &status, 0); /* okay, got EPIPE */
-    } while (err == -1 && errno == EINTR);
+    if (r == 0) {
+      ; /* okay, EOF */
+    } else if (r == sizeof(exec_errorno)) {
+      processx__wait_child(result, 0); /* okay, read errorno */
 
-  } else {
-    goto cleanup;
-  }
+    } else if (r == -1 && errno == EPIPE) {
+      processx__wait_child(result, 0); /* okay, got EPIPE */
 
-  if (signal_pipe[0] >= 0) close(signal_pipe[0]);
+    } else {
+      goto cleanup;
+    }
+
+    if (signal_pipe[0] >= 0) close(signal_pipe[0]);
+  }
 
   /* Set fds for standard I/O */
-  /* TODO: implement stdin */
   handle->fd0 = handle->fd1 = handle->fd2 = -1;
+  if (pipes[0][0] >= 0) {
+    handle->fd0 = pipes[0][0];
+    processx__nonblock_fcntl(handle->fd0, 1);
+#ifdef SO_NOSIGPIPE
+    {
+      int one = 1;
+      setsockopt(handle->fd0, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+    }
+#endif
+  }
   if (pipes[1][0] >= 0) {
     handle->fd1 = pipes[1][0];
     processx__nonblock_fcntl(handle->fd1, 1);
@@ -351,27 +603,49 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP std_out, SEXP std_err,
   }
 
   /* Closed unused ends of pipes */
+  if (pipes[0][1] >= 0) close(pipes[0][1]);
   if (pipes[1][1] >= 0) close(pipes[1][1]);
   if (pipes[2][1] >= 0) close(pipes[2][1]);
+  if (done_pipe[1] >= 0) close(done_pipe[1]);
+  handle->file_done_fd = done_pipe[0];
 
   /* Create proper connections */
   processx__create_connections(handle, private, cencoding);
+  if (coptions.readahead) {
+    int i;
+    for (i = 1; i <= 2; i++) {
+      processx_connection_t *ccon = handle->pipes[i];
+      if (ccon && ccon->type == PROCESSX_FILE_TYPE_ASYNCPIPE) {
+	processx__readahead_add(ccon, coptions.readahead,
+				coptions.spill_dir);
+      }
+    }
+  }
+  if (coptions.shm_memfd >= 0) {
+    processx__shm_create_connection(handle, coptions.shm_memfd, private,
+				    cencoding);
+  }
 
   if (exec_errorno == 0) {
-    handle->pid = pid;
+    processx__stats.spawns++;
+    processx__stats.spawn_time += processx__now() - start_time;
+    PROCESSX_TRACE3(exec__end, pid, 0, PROCESSX_TRACE_NS(start_time));
     UNPROTECT(1);		/* result */
     return result;
   }
 
  cleanup:
+  PROCESSX_TRACE3(exec__end, pid, exec_errorno,
+		  PROCESSX_TRACE_NS(start_time));
   error("processx error");
 }
 
-void processx__collect_exit_status(SEXP status, int wstat) {
+void processx__collect_exit_status(SEXP status, int wstat,
+				   struct rusage *rusage) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
 
-  /* This must be called from a function that blocks SIGCHLD.
-     So we are not blocking it here. */
+  /* This is only called on the main thread, never from the SIGCHLD
+     handler, see unix/sigchld.c. */
 
   if (!handle) {
     error("Invalid handle, already finalized");
@@ -386,6 +660,13 @@ void processx__collect_exit_status(SEXP status, int wstat) {
     handle->exitcode = - WTERMSIG(wstat);
   }
 
+  /* This is what the kernel recorded for the child and its waited-for
+     descendants, we just keep it. */
+  if (rusage) handle->rusage = *rusage;
+
+  /* No more data in the shared memory channel, wake up the reader */
+  processx__shm_writer_exited(handle);
+
   handle->collected = 1;
 }
 
@@ -395,100 +676,76 @@ void processx__collect_exit_status(SEXP status, int wstat) {
  *    A good strategy is to avoid calling R functions here completely.
  *    Functions that return immediately, like `R_CheckUserInterrupt`, or
  *    a `ScalarLogical` that we return, are fine.
- * 3. The SIGCHLD handler that we just block at the beginning, but it can
- *    still be called between the R function doing the `.Call` to us, and
- *    the signal blocking call.
+ * 3. The SIGCHLD handler, that can be called at any time. It only reaps
+ *    the children, and queues their exit statuses, see unix/sigchld.c.
+ *    The handles are updated here, on the main thread, when we drain
+ *    the queue. So we don't need to block SIGCHLD.
  *
  * Keeping these in mind, we do this:
  *
  * 1. If the exit status was copied over to R already, we return
  *    immediately from R. Otherwise this C function is called.
- * 2. We block SIGCHLD.
- * 3. If we already collected the exit status, then this process has
- *    finished, so we don't need to wait.
- * 4. We set up a self-pipe that we can poll. The pipe will be closed in
- *    the SIGCHLD signal handler, and that triggers the poll event.
- * 5. We unblock the SIGCHLD handler, so that it can trigger the pipe event.
- * 6. We start polling. We poll in small time chunks, to keep the wait still
- *    interruptible.
- * 7. We keep polling until the timeout expires or the process finishes.
+ * 2. We drain the notification pipe, and then the exit queue. If we
+ *    collected the exit status, then this process has finished, so we
+ *    don't need to wait. We also check that our SIGCHLD handler is
+ *    still installed, but not at every call, see unix/sigchld.c.
+ * 3. Otherwise we poll the notification pipe. The SIGCHLD handler writes
+ *    to it after it has queued an exit status, so we cannot miss an exit
+ *    that happens after step 2.
+ * 4. We poll in small time chunks, to keep the wait still interruptible.
+ * 5. We keep polling until the timeout expires or the process finishes.
  */
 
 SEXP processx_wait(SEXP status, SEXP timeout) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
-  int ctimeout = INTEGER(timeout)[0], timeleft = ctimeout;
+  int ctimeout = INTEGER(timeout)[0];
+  double start = processx__now();
   struct pollfd fd;
-  int ret = 0;
-  pid_t pid;
 
-  processx__block_sigchld();
-
-  if (!handle) {
-    processx__unblock_sigchld();
-    error("Internal processx error, handle already removed");
-  }
-
-  pid = handle->pid;
+  if (!handle) error("Internal processx error, handle already removed");
 
   /* If we already have the status, then return now. */
-  if (handle->collected) {
-    processx__unblock_sigchld();
-    return ScalarLogical(1);
-  }
+  processx__drain_exits();
+  if (handle->collected) return ScalarLogical(1);
 
   /* Make sure this is active, in case another package replaced it... */
-  processx__setup_sigchld();
-  processx__block_sigchld();
-
-  /* Setup the self-pipe that we can poll */
-  if (pipe(handle->waitpipe)) {
-    processx__unblock_sigchld();
-    error("processx error: %s", strerror(errno));
-  }
-  processx__nonblock_fcntl(handle->waitpipe[0], 1);
-  processx__nonblock_fcntl(handle->waitpipe[1], 1);
+  processx__check_sigchld();
+  processx__notify_init();
 
-  /* Poll on the pipe, need to unblock sigchld before */
-  fd.fd = handle->waitpipe[0];
+  fd.fd = processx__notify_pipe[0];
   fd.events = POLLIN;
-  fd.revents = 0;
 
-  processx__unblock_sigchld();
-
-  while (ctimeout < 0 || timeleft > PROCESSX_INTERRUPT_INTERVAL) {
-    do {
-      ret = poll(&fd, 1, PROCESSX_INTERRUPT_INTERVAL);
-    } while (ret == -1 && errno == EINTR);
+  while (1) {
+    int ret, wait = PROCESSX_INTERRUPT_INTERVAL;
 
-    /* If not a timeout, then we are done */
-    if (ret != 0) break;
+    processx__notify_drain();
+    processx__drain_exits();
+    if (handle->collected) break;
 
-    R_CheckUserInterrupt();
-
-    /* We also check if the process is alive, because the SIGCHLD is
-       not delivered in valgrind :( */
-    ret = kill(pid, 0);
-    if (ret != 0) return ScalarLogical(1);
-
-    if (ctimeout >= 0) timeleft -= PROCESSX_INTERRUPT_INTERVAL;
-  }
+    if (ctimeout >= 0) {
+      int timeleft = ctimeout - (processx__now() - start) * 1000;
+      if (timeleft <= 0) break;
+      if (timeleft < wait) wait = timeleft;
+    }
 
-  /* Maybe we are not done, and there is a little left from the timeout */
-  if (ret == 0 && timeleft >= 0) {
+    fd.revents = 0;
     do {
-      ret = poll(&fd, 1, timeleft);
+      ret = poll(&fd, 1, wait);
     } while (ret == -1 && errno == EINTR);
-  }
 
-  if (ret == -1) {
-    error("processx wait with timeout error: %s", strerror(errno));
-  }
+    if (ret == -1) {
+      error("processx wait with timeout error: %s", strerror(errno));
+    }
 
-  if (handle->waitpipe[0] >= 0) close(handle->waitpipe[0]);
-  if (handle->waitpipe[1] >= 0) close(handle->waitpipe[1]);
-  handle->waitpipe[0] = -1;
+    if (ret == 0) {
+      R_CheckUserInterrupt();
+      /* We also check if the process is alive, because the SIGCHLD is
+	 not delivered in valgrind :( */
+      processx__wait_child(status, WNOHANG);
+    }
+  }
 
-  return ScalarLogical(ret != 0);
+  return ScalarLogical(handle->collected);
 }
 
 /* This is similar to `processx_wait`, but a bit simpler, because we
@@ -497,52 +754,21 @@ SEXP processx_wait(SEXP status, SEXP timeout) {
  *
  * 1. If the exit status was copied over to R already, we return
  *    immediately from R. Otherwise this C function is called.
- * 2. We block SIGCHLD.
- * 3. If we already collected the exit status, then this process has
- *    finished, and we return FALSE.
- * 4. Otherwise we do a non-blocking `waitpid`, because the process might
- *    have finished, we just haven't collected its exit status yet.
- * 5. If the process is still running, `waitpid` returns 0. We return TRUE.
- * 6. Otherwise we collect the exit status, and return FALSE.
+ * 2. We drain the exit queue. If we collected the exit status, then this
+ *    process has finished, and we return FALSE.
+ * 3. Otherwise, if our SIGCHLD handler was checked recently, then it is
+ *    still running, and we return TRUE. No system calls are needed for
+ *    this, see `processx__child_exited()`.
+ * 4. Otherwise we check the handler, and reap the children that have
+ *    exited, on the main thread, in case we have missed some.
  */
 
 SEXP processx_is_alive(SEXP status) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
-  pid_t pid;
-  int wstat, wp;
-  int ret = 0;
 
-  processx__block_sigchld();
+  if (!handle) error("Internal processx error, handle already removed");
 
-  if (!handle) {
-    processx__unblock_sigchld();
-    error("Internal processx error, handle already removed");
-  }
-
-  if (handle->collected) goto cleanup;
-
-  /* Otherwise a non-blocking waitpid to collect zombies */
-  pid = handle->pid;
-  do {
-    wp = waitpid(pid, &wstat, WNOHANG);
-  } while (wp == -1 && errno == EINTR);
-
-  /* Some other error? */
-  if (wp == -1) {
-    processx__unblock_sigchld();
-    error("processx_is_alive: %s", strerror(errno));
-  }
-
-  /* If running, return TRUE, otherwise collect exit status, return FALSE */
-  if (wp == 0) {
-    ret = 1;
-  } else {
-    processx__collect_exit_status(status, wstat);
-  }
-
- cleanup:
-  processx__unblock_sigchld();
-  return ScalarLogical(ret);
+  return ScalarLogical(!processx__child_exited(status));
 }
 
 /* This is essentially the same as `processx_is_alive`, but we return an
@@ -551,170 +777,235 @@ SEXP processx_is_alive(SEXP status) {
 
 SEXP processx_get_exit_status(SEXP status) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
-  pid_t pid;
-  int wstat, wp;
-  SEXP result;
 
-  processx__block_sigchld();
-
-  if (!handle) {
-    processx__unblock_sigchld();
-    error("Internal processx error, handle already removed");
-  }
-
-  /* If we already have the status, then just return */
-  if (handle->collected) {
-    result = PROTECT(ScalarInteger(handle->exitcode));
-    goto cleanup;
-  }
-
-  /* Otherwise do a non-blocking waitpid to collect zombies */
-  pid = handle->pid;
-  do {
-    wp = waitpid(pid, &wstat, WNOHANG);
-  } while (wp == -1 && errno == EINTR);
-
-  /* Some other error? */
-  if (wp == -1) {
-    processx__unblock_sigchld();
-    error("processx_get_exit_status: %s", strerror(errno));
-  }
-
-  /* If running, do nothing otherwise collect */
-  if (wp == 0) {
-    result = PROTECT(R_NilValue);
-  } else {
-    processx__collect_exit_status(status, wstat);
-    result = PROTECT(ScalarInteger(handle->exitcode));
-  }
+  if (!handle) error("Internal processx error, handle already removed");
 
- cleanup:
-  processx__unblock_sigchld();
-  UNPROTECT(1);
-  return result;
+  /* If still running, return NULL */
+  if (!processx__child_exited(status)) return R_NilValue;
+  return ScalarInteger(handle->exitcode);
 }
 
 /* See `processx_wait` above for the description of async processes and
  * possible race conditions.
  *
- * This is mostly along the lines of `processx_is_alive`. After we
- * successfully sent the signal, we try a `waitpid` just in case the
- * processx has aborted on it. This is a harmless race condition, because
- * the process might not have been cleaned up yet, when we call `waitpid`,
- * but that's OK, then its exit status will be collected later, e.g. in
- * the SIGCHLD handler.
+ * This is mostly along the lines of `processx_is_alive`. If the process
+ * dies because of the signal, then its exit status will be collected
+ * later, from the exit queue.
  */
 
 SEXP processx_signal(SEXP status, SEXP signal) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
-  pid_t pid;
-  int wstat, wp, ret, result;
+  int ret, result;
 
-  processx__block_sigchld();
-
-  if (!handle) {
-    processx__unblock_sigchld();
-    error("Internal processx error, handle already removed");
-  }
+  if (!handle) error("Internal processx error, handle already removed");
 
   /* If we already have the status, then return `FALSE` */
-  if (handle->collected) {
-    result = 0;
-    goto cleanup;
-  }
+  if (processx__child_exited(status)) return ScalarLogical(0);
 
   /* Otherwise try to send signal */
-  pid = handle->pid;
-  ret = kill(pid, INTEGER(signal)[0]);
+  ret = kill(handle->pid, INTEGER(signal)[0]);
 
   if (ret == 0) {
     result = 1;
   } else if (ret == -1 && errno == ESRCH) {
     result = 0;
   } else {
-    processx__unblock_sigchld();
     error("processx_signal: %s", strerror(errno));
     return R_NilValue;
   }
 
-  /* Possibly dead now, collect status */
+  return ScalarLogical(result);
+}
+
+/* Killing processes, with a grace period
+ *
+ * Without a grace period we send a SIGKILL to the process group of each
+ * process. With a grace period we send a SIGTERM first, so the process
+ * can clean up, and wait for the exit notifications, see wait.c, until
+ * all of them exited, or the grace period is over. Then we send a
+ * SIGKILL to the rest. We signal all processes before waiting for any
+ * of them, so they are killed in parallel.
+ *
+ * We make an effort to return a TRUE/FALSE value to indicate if the
+ * process died as a response to our signals. This is not 100% accurate
+ * because of the unavoidable race conditions. (E.g. it might have been
+ * killed by another process's KILL signal.) A process counts as killed
+ * if it was still alive when we signalled it, and it was terminated by
+ * SIGTERM or SIGKILL, or it exited during the grace period. If it had
+ * finished already, but we did not reap it yet, then we still signal its
+ * process group, but it was not killed by us.
+ */
+
+/* Whether the child has exited, without reaping it. If the SIGCHLD
+   handler reaped it already, then we get ECHILD. */
+
+static int processx__has_exited(pid_t pid) {
+  siginfo_t info;
+  int ret;
+  memset(&info, 0, sizeof(info));
   do {
-    wp = waitpid(pid, &wstat, WNOHANG);
-  } while (wp == -1 && errno == EINTR);
+    ret = waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == -1) return errno == ECHILD;
+  return info.si_pid == pid;
+}
 
-  if (wp == -1) {
-    processx__unblock_sigchld();
-    error("processx_get_exit_status: %s", strerror(errno));
+static void processx__kill_many(SEXP statuses, double grace, int *result) {
+  int i, n = LENGTH(statuses), nsig = 0;
+  processx_handle_t **signaled;
+  int *alive, *waited;
+  int sig = grace > 0 ? SIGTERM : SIGKILL;
+
+  signaled = (processx_handle_t**) R_alloc(n, sizeof(processx_handle_t*));
+  alive = (int*) R_alloc(n, sizeof(int));
+  waited = (int*) R_alloc(n, sizeof(int));
+
+  for (i = 0; i < n; i++) {
+    SEXP status = VECTOR_ELT(statuses, i);
+    processx_handle_t *handle = R_ExternalPtrAddr(status);
+    int ret;
+
+    if (!handle) error("Internal processx error, handle already removed");
+    result[i] = 0;
+    alive[i] = waited[i] = 0;
+
+    /* Check if we have an exit status, it yes, it is not killed */
+    if (processx__child_exited(status)) continue;
+    alive[i] = !processx__has_exited(handle->pid);
+
+    ret = kill(-handle->pid, sig);
+    if (ret == -1 && errno == ESRCH) continue;
+    if (ret == -1) error("process_kill: %s", strerror(errno));
+    signaled[nsig++] = handle;
+    result[i] = 1;
   }
 
- cleanup:
-  processx__unblock_sigchld();
+  if (nsig > 0 && grace > 0) {
+    double ms = grace * 1000;
+    if (!processx__wait_handles(signaled, nsig, /* all= */ 1,
+				ms > INT_MAX ? INT_MAX : (int) ms)) {
+      for (i = 0; i < nsig; i++) {
+	if (!signaled[i]->collected) kill(-signaled[i]->pid, SIGKILL);
+      }
+    }
+    for (i = 0; i < n; i++) {
+      processx_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+      waited[i] = result[i] && handle->collected;
+    }
+  }
+
+  /* Do a waitpid to collect the status and reap the zombies */
+  for (i = 0; i < n; i++) {
+    SEXP status = VECTOR_ELT(statuses, i);
+    processx_handle_t *handle = R_ExternalPtrAddr(status);
+    if (result[i]) {
+      if (!handle->collected) processx__wait_child(status, 0);
+      /* Check if it was killed by a signal. If yes, this was most
+	 probably us (although we cannot be sure in general... */
+      result[i] = alive[i] && handle->collected &&
+	(handle->exitcode == - SIGKILL || handle->exitcode == - SIGTERM ||
+	 waited[i]);
+    }
+    PROCESSX_TRACE2(kill, handle->pid, result[i]);
+  }
+}
+
+SEXP processx_kill(SEXP status, SEXP grace) {
+  double cgrace = REAL(grace)[0];
+  SEXP statuses = PROTECT(allocVector(VECSXP, 1));
+  int result;
+
+  SET_VECTOR_ELT(statuses, 0, status);
+  processx__kill_many(statuses, cgrace, &result);
+
+  UNPROTECT(1);
   return ScalarLogical(result);
 }
 
-/* This is a special case of `processx_signal`, and we implement it almost
- * the same way. We make an effort to return a TRUE/FALSE value to indicate
- * if the process died as a response to our KILL signal. This is not 100%
- * accurate because of the unavoidable race conditions. (E.g. it might have
- * been killed by another process's KILL signal.)
+SEXP processx_kill_many(SEXP statuses, SEXP grace) {
+  SEXP result = PROTECT(allocVector(LGLSXP, LENGTH(statuses)));
+
+  processx__kill_many(statuses, REAL(grace)[0], LOGICAL(result));
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Async start
  *
- * To do a better job for the return value, we call a `waitpid` before
- * delivering the signal, as a final check to see if the child process is
- * still alive or not.
+ * With the `async_start` option `processx_exec()` does not wait for the
+ * child to exec(), or to report an error. The read end of the pipe that
+ * carries the exec status stays in the handle, in `exec_fd`, and we read
+ * it when somebody asks. If the child closes the pipe without writing
+ * to it, then exec() was successful. Otherwise the child sends `-errno`
+ * and kills itself, the SIGCHLD handler will collect its exit status.
  */
 
-SEXP processx_kill(SEXP status, SEXP grace) {
-  processx_handle_t *handle = R_ExternalPtrAddr(status);
-  pid_t pid;
-  int wstat, wp, result = 0;
-
-  processx__block_sigchld();
+int processx__start_status(processx_handle_t *handle, int block) {
+  int exec_errorno;
+  ssize_t r;
 
-  if (!handle) {
-    processx__unblock_sigchld();
-    error("Internal processx error, handle already removed");
+  if (handle->start_state != PROCESSX_START_STARTING) {
+    return handle->start_state;
   }
 
-  /* Check if we have an exit status, it yes, just return (FALSE) */
-  if (handle->collected) { goto cleanup; }
+  if (block) processx__nonblock_fcntl(handle->exec_fd, 0);
 
-  /* Do a non-blocking waitpid to collect zombies */
-  pid = handle->pid;
   do {
-    wp = waitpid(pid, &wstat, WNOHANG);
-  } while (wp == -1 && errno == EINTR);
+    r = read(handle->exec_fd, &exec_errorno, sizeof(exec_errorno));
+  } while (r == -1 && errno == EINTR);
 
-  /* Some other error? */
-  if (wp == -1) {
-    processx__unblock_sigchld();
-    error("processx_kill: %s", strerror(errno));
+  if (r == -1 && errno == EAGAIN) return handle->start_state;
+
+  if (r == sizeof(exec_errorno)) {
+    handle->start_state = PROCESSX_START_EXEC_FAILED;
+    handle->exec_errno = - exec_errorno;
+  } else {
+    handle->start_state = PROCESSX_START_STARTED;
   }
 
-  /* If the process is not running, return (FALSE) */
-  if (wp != 0) { goto cleanup; }
+  close(handle->exec_fd);
+  handle->exec_fd = -1;
 
-  /* It is still running, so a SIGKILL */
-  int ret = kill(-pid, SIGKILL);
-  if (ret == -1 && errno == ESRCH) { goto cleanup; }
-  if (ret == -1) {
-    processx__unblock_sigchld();
-    error("process_kill: %s", strerror(errno));
+  return handle->start_state;
+}
+
+/* Poll method for the start of the process. Once the start was reported
+   by `poll()`, this does not generate events any more. */
+
+int processx__poll_func_start(void *object, int status, int *handle,
+			      int *again) {
+  processx_handle_t *phandle = (processx_handle_t*) object;
+  int state = processx__start_status(phandle, /* block= */ 0);
+
+  if (again) *again = 0;
+
+  if (state == PROCESSX_START_STARTING) {
+    if (handle) *handle = phandle->exec_fd;
+    return PXSILENT;
   }
 
-  /* Do a waitpid to collect the status and reap the zombie */
-  do {
-    wp = waitpid(pid, &wstat, 0);
-  } while (wp == -1 && errno == EINTR);
+  if (phandle->start_reported) return PXNOPIPE;
+  return state == PROCESSX_START_STARTED ? PXSTARTED : PXEXECFAILED;
+}
 
-  /* Collect exit status, and check if it was killed by a SIGKILL
-     If yes, this was most probably us (although we cannot be sure in
-     general... */
-  processx__collect_exit_status(status, wstat);
-  result = handle->exitcode == - SIGKILL;
+SEXP processx_get_start_status(SEXP status) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  static const char *states[] = { "started", "starting", "exec_failed" };
+  int state;
+  SEXP result;
 
- cleanup:
-  processx__unblock_sigchld();
-  return ScalarLogical(result);
+  if (!handle) error("Internal processx error, handle already removed");
+
+  state = processx__start_status(handle, /* block= */ 0);
+  result = PROTECT(mkString(states[state]));
+  if (state == PROCESSX_START_EXEC_FAILED) {
+    setAttrib(result, install("error"),
+	      mkString(strerror(handle->exec_errno)));
+  }
+
+  UNPROTECT(1);
+  return result;
 }
 
 SEXP processx_get_pid(SEXP status) {
@@ -725,6 +1016,57 @@ SEXP processx_get_pid(SEXP status) {
   return ScalarInteger(handle->pid);
 }
 
+/* Vectorized versions of the queries above. The status of the processes
+ * is cached, see `processx_is_alive`, so these are mostly free of system
+ * calls, the cost is in the R calls, that we save here.
+ */
+
+SEXP processx_is_alive_many(SEXP statuses) {
+  int i, n = LENGTH(statuses);
+  SEXP result = PROTECT(allocVector(LGLSXP, n));
+
+  for (i = 0; i < n; i++) {
+    SEXP status = VECTOR_ELT(statuses, i);
+    if (!R_ExternalPtrAddr(status)) {
+      error("Internal processx error, handle already removed");
+    }
+    LOGICAL(result)[i] = !processx__child_exited(status);
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_exit_status_many(SEXP statuses) {
+  int i, n = LENGTH(statuses);
+  SEXP result = PROTECT(allocVector(INTSXP, n));
+
+  for (i = 0; i < n; i++) {
+    SEXP status = VECTOR_ELT(statuses, i);
+    processx_handle_t *handle = R_ExternalPtrAddr(status);
+    if (!handle) error("Internal processx error, handle already removed");
+    INTEGER(result)[i] =
+      processx__child_exited(status) ? handle->exitcode : NA_INTEGER;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_pids_many(SEXP statuses) {
+  int i, n = LENGTH(statuses);
+  SEXP result = PROTECT(allocVector(INTSXP, n));
+
+  for (i = 0; i < n; i++) {
+    processx_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+    if (!handle) error("Internal processx error, handle already removed");
+    INTEGER(result)[i] = handle->pid;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
 /* We send a 0 signal to check if the process is alive. Note that a process
  * that is in a zombie state also counts as 'alive' with this method.
 */
@@ -0,0 +1,652 @@
+
+#ifndef _WIN32
+
+#include "../processx.h"
+
+#include <pthread.h>
+
+/* Read-ahead I/O thread
+ *
+ * Child processes block when the pipe of their standard output or error
+ * is full, and the pipes are only read when R calls `read_*()` or
+ * `poll()`. So if R is busy, the children stall. With the `readahead`
+ * option of `process$new()` a background thread reads the pipes of the
+ * process, and converts the output to UTF-8, while R is busy.
+ *
+ * There is a single I/O thread per R session. It is started when the
+ * first connection is registered, and it stops when the package is
+ * unloaded. It polls all registered connections, and a wake pipe, that
+ * we use to tell it that the set of connections has changed.
+ *
+ * Each connection has a single producer, single consumer queue of
+ * chunks. The I/O thread pushes UTF-8 chunks into it, and R pops them,
+ * see `processx__connection_read()`. After pushing, the thread writes a
+ * byte into the notification pipe of the connection, so R can poll it.
+ * R drains the notification pipe before popping, so it cannot miss a
+ * chunk.
+ *
+ * Backpressure: if the queued chunks use `cap` bytes, or the queue is
+ * full, then the thread stops reading the connection, so the child will
+ * block, once the pipe is full. R wakes up the thread when it has
+ * consumed some data.
+ *
+ * Spilling: if the connection has a spill file, then the thread does not
+ * stop reading. Instead, it appends the chunks that do not fit into the
+ * queue to the (unlinked) spill file. Every queued chunk records the
+ * size of the spill file when it was pushed, and R reads the file up to
+ * this offset before it uses the chunk, so the order of the data is
+ * kept. A queue slot is kept free for the EOF chunk.
+ *
+ * The list of connections is protected by a mutex, this is only used
+ * when connections are added or removed. Removed connections are only
+ * unlinked by the I/O thread, so it can use them without locking.
+ * (The R thread waits until the thread acknowledges the removal.)
+ *
+ * The I/O thread does not call R, except for `Riconv()`, which is a
+ * plain wrapper on `iconv()`. Errors are passed to R in the last chunk.
+ */
+
+#define PROCESSX__READAHEAD_SLOTS 256
+#define PROCESSX__READAHEAD_CHUNK (64 * 1024)
+
+typedef struct processx__readahead_s {
+  int fd;
+  void *iconv_ctx;
+  size_t cap;
+  int notify[2];		/* readable if there are chunks */
+
+  /* The queue, the I/O thread writes `head`, R writes `tail` */
+  processx__chunk_t *queue[PROCESSX__READAHEAD_SLOTS];
+  unsigned int head;
+  unsigned int tail;
+  size_t queued;		/* bytes in the queue */
+  int throttled;		/* the thread is not reading it now */
+  int detached;			/* the thread has failed, R reads the fd */
+
+  /* Spill file, -1 if none. The I/O thread writes `spill_written`, R
+     writes `spill_read`. */
+  int spill_fd;
+  off_t spill_written;
+  off_t spill_read;
+
+  /* I/O thread only. An incomplete multi-byte character, from the end
+     of the previous read. */
+  char carry[8];
+  size_t carry_size;
+  int done;			/* the last chunk was pushed */
+
+  /* Protected by `lock` */
+  int closing;
+  int removed;
+  struct processx__readahead_s *next;
+} processx__readahead_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t removed_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+static int running = 0;
+static int stopping = 0;
+static int wake_pipe[2] = { -1, -1 };
+static processx__readahead_t *connections = 0;
+
+static void processx__readahead_wake() {
+  ssize_t ret = write(wake_pipe[1], "x", 1);
+  (void) ret;
+}
+
+static void processx__readahead_notify(processx__readahead_t *ra) {
+  ssize_t ret = write(ra->notify[1], "x", 1);
+  (void) ret;
+}
+
+static void processx__drain_pipe(int fd) {
+  char buf[256];
+  ssize_t ret;
+  do {
+    ret = read(fd, buf, sizeof(buf));
+  } while (ret > 0 || (ret == -1 && errno == EINTR));
+}
+
+static int processx__readahead_make_pipe(int fds[2]) {
+  if (pipe(fds)) return -1;
+  processx__cloexec_fcntl(fds[0], 1);
+  processx__cloexec_fcntl(fds[1], 1);
+  processx__nonblock_fcntl(fds[0], 1);
+  processx__nonblock_fcntl(fds[1], 1);
+  return 0;
+}
+
+/* --------------------------------------------------------------------- */
+/* The I/O thread                                                        */
+/* --------------------------------------------------------------------- */
+
+static void processx__readahead_push(processx__readahead_t *ra,
+				     processx__chunk_t *chunk) {
+  unsigned int head = ra->head;
+  /* R may free the chunk as soon as it is published */
+  if (chunk->eof) ra->done = 1;
+  chunk->spill_offset = ra->spill_written;
+  ra->queue[head % PROCESSX__READAHEAD_SLOTS] = chunk;
+  __atomic_add_fetch(&ra->queued, chunk->size, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&ra->head, head + 1, __ATOMIC_RELEASE);
+  processx__readahead_notify(ra);
+}
+
+/* Whether the thread should read this connection now. If not, then we
+   mark it as throttled, and R will wake us up. We need to check again
+   after marking it, because R might have just consumed everything. */
+
+static int processx__readahead_wants(processx__readahead_t *ra) {
+  int i;
+  if (ra->done) return 0;
+  if (ra->spill_fd != -1) return 1;
+  for (i = 0; i < 2; i++) {
+    unsigned int used = ra->head -
+      __atomic_load_n(&ra->tail, __ATOMIC_ACQUIRE);
+    size_t queued = __atomic_load_n(&ra->queued, __ATOMIC_SEQ_CST);
+    if (used < PROCESSX__READAHEAD_SLOTS && queued < ra->cap) {
+      if (i == 1) __atomic_store_n(&ra->throttled, 0, __ATOMIC_SEQ_CST);
+      return 1;
+    }
+    if (i == 0) __atomic_store_n(&ra->throttled, 1, __ATOMIC_SEQ_CST);
+  }
+  return 0;
+}
+
+static int processx__readahead_write(int fd, const char *buf, size_t size,
+				     off_t offset) {
+  while (size > 0) {
+    ssize_t ret = pwrite(fd, buf, size, offset);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret == -1) return -1;
+    buf += ret;
+    size -= ret;
+    offset += ret;
+  }
+  return 0;
+}
+
+/* Push a data chunk into the queue, or write it to the spill file. */
+
+static void processx__readahead_deliver(processx__readahead_t *ra,
+					processx__chunk_t *chunk) {
+  unsigned int used;
+  size_t queued;
+
+  if (ra->spill_fd != -1) {
+    used = ra->head - __atomic_load_n(&ra->tail, __ATOMIC_ACQUIRE);
+    queued = __atomic_load_n(&ra->queued, __ATOMIC_SEQ_CST);
+    if (used >= PROCESSX__READAHEAD_SLOTS - 1 || queued >= ra->cap) {
+      if (processx__readahead_write(ra->spill_fd, chunk->data, chunk->size,
+				    ra->spill_written)) {
+	/* E.g. the disk is full. R will get an error, after the data
+	   that was already written. */
+	int err = errno;
+	memset(chunk, 0, sizeof(processx__chunk_t));
+	chunk->eof = 1;
+	chunk->err = err;
+	processx__readahead_push(ra, chunk);
+	return;
+      }
+      __atomic_store_n(&ra->spill_written, ra->spill_written + chunk->size,
+		       __ATOMIC_RELEASE);
+      free(chunk);
+      processx__readahead_notify(ra);
+      return;
+    }
+  }
+
+  processx__readahead_push(ra, chunk);
+}
+
+/* Read once, and push a chunk, if there is anything to push. Returns
+   -1 if there is no memory for the chunk. Then nothing was read, the
+   data is still in the pipe, and the carry is still in `ra`, so R can
+   take over the connection without losing anything. */
+
+static int processx__readahead_fill(processx__readahead_t *ra,
+				    char *buf) {
+  ssize_t n;
+  const char *inbuf;
+  char *outbuf;
+  size_t inleft, outleft, outsize;
+  processx__chunk_t *chunk, *small;
+
+  /* UTF-8 needs at most four bytes per character, in any encoding. We
+     allocate before reading, and give back the unused part later. */
+  outsize = PROCESSX__READAHEAD_CHUNK * 4 + 16;
+  chunk = malloc(sizeof(processx__chunk_t) + outsize);
+  if (!chunk) return -1;
+  memset(chunk, 0, sizeof(processx__chunk_t));
+  chunk->reads = 1;
+
+  memcpy(buf, ra->carry, ra->carry_size);
+  do {
+    n = read(ra->fd, buf + ra->carry_size,
+	     PROCESSX__READAHEAD_CHUNK - ra->carry_size);
+  } while (n == -1 && errno == EINTR);
+  PROCESSX_TRACE3(read, ra->fd, PROCESSX__READAHEAD_CHUNK - ra->carry_size,
+		  n);
+
+  if (n == -1 && errno == EAGAIN) {
+    free(chunk);
+    return 0;
+  }
+
+  if (n <= 0) {
+    /* EOF or error, this is the last chunk */
+    small = realloc(chunk, sizeof(processx__chunk_t));
+    if (small) chunk = small;
+    chunk->eof = 1;
+    chunk->err = n == -1 ? errno : 0;
+    chunk->invalid_tail = ra->carry_size > 0;
+    processx__readahead_push(ra, chunk);
+    return 0;
+  }
+
+  inleft = ra->carry_size + n;
+  chunk->raw_bytes = n;
+
+  inbuf = buf;
+  outbuf = chunk->data;
+  outleft = outsize;
+  while (inleft > 0) {
+    size_t r = Riconv(ra->iconv_ctx, &inbuf, &inleft, &outbuf, &outleft);
+    chunk->iconv_calls++;
+    if (r != (size_t) -1) break;
+    if (errno == EILSEQ) {
+      /* Invalid input, skip a byte, like processx__connection_to_utf8 */
+      inbuf++; inleft--;
+    } else {
+      /* EINVAL: incomplete character at the end, keep it for later.
+	 E2BIG cannot happen, but if it does, we drop the rest. */
+      break;
+    }
+  }
+
+  ra->carry_size = inleft < sizeof(ra->carry) ? inleft : 0;
+  memcpy(ra->carry, inbuf, ra->carry_size);
+
+  chunk->size = outbuf - chunk->data;
+  if (chunk->size == 0) {
+    free(chunk);
+    return 0;
+  }
+
+  small = realloc(chunk, sizeof(processx__chunk_t) + chunk->size);
+  if (small) chunk = small;
+  processx__readahead_deliver(ra, chunk);
+  return 0;
+}
+
+/* This is only called if the thread cannot allocate memory, or poll()
+   fails, both are very unlikely. We give the connections back to R:
+   the data that was already read is in the queues, R serves that first,
+   and then it reads the pipe itself. `lock` is held here. */
+
+static void processx__readahead_failed() {
+  processx__readahead_t *ra;
+  for (ra = connections; ra; ra = ra->next) {
+    ra->removed = 1;
+    __atomic_store_n(&ra->detached, 1, __ATOMIC_RELEASE);
+    processx__readahead_notify(ra);
+  }
+  connections = 0;
+  pthread_cond_broadcast(&removed_cond);
+  close(wake_pipe[0]);
+  close(wake_pipe[1]);
+  wake_pipe[0] = wake_pipe[1] = -1;
+  running = 0;
+  pthread_detach(pthread_self());
+}
+
+static void *processx__readahead_thread(void *arg) {
+  size_t size = 64;
+  struct pollfd *fds = malloc(size * sizeof(*fds));
+  processx__readahead_t **ras = malloc(size * sizeof(*ras));
+  char *buf = malloc(PROCESSX__READAHEAD_CHUNK + 8);
+  int failed = 0;
+
+  while (buf && fds && ras && !failed) {
+    processx__readahead_t *ra, **prev;
+    size_t i, n = 1;
+    int ret;
+
+    pthread_mutex_lock(&lock);
+    if (stopping) {
+      pthread_mutex_unlock(&lock);
+      break;
+    }
+
+    /* Acknowledge the removals, and collect the connections to poll */
+    for (prev = &connections, ra = connections; ra; ra = *prev) {
+      if (ra->closing) {
+	*prev = ra->next;
+	ra->removed = 1;
+	pthread_cond_broadcast(&removed_cond);
+	continue;
+      }
+      if (n >= size) {
+	size_t newsize = size * 2;
+	struct pollfd *newfds = realloc(fds, newsize * sizeof(*fds));
+	processx__readahead_t **newras;
+	if (newfds) fds = newfds;
+	newras = realloc(ras, newsize * sizeof(*ras));
+	if (newras) ras = newras;
+	if (newfds && newras) size = newsize;
+      }
+      if (n < size && processx__readahead_wants(ra)) {
+	fds[n].fd = ra->fd;
+	fds[n].events = POLLIN;
+	ras[n] = ra;
+	n++;
+      }
+      prev = &ra->next;
+    }
+    pthread_mutex_unlock(&lock);
+
+    fds[0].fd = wake_pipe[0];
+    fds[0].events = POLLIN;
+    for (i = 0; i < n; i++) fds[i].revents = 0;
+
+    do {
+      ret = poll(fds, n, -1);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) break;
+
+    if (fds[0].revents) processx__drain_pipe(wake_pipe[0]);
+    for (i = 1; i < n && !failed; i++) {
+      if (fds[i].revents) failed = processx__readahead_fill(ras[i], buf);
+    }
+  }
+
+  free(fds);
+  free(ras);
+  free(buf);
+
+  /* If we failed, then R reads the connections directly from now on */
+  pthread_mutex_lock(&lock);
+  if (!stopping) processx__readahead_failed();
+  pthread_mutex_unlock(&lock);
+
+  return 0;
+}
+
+/* --------------------------------------------------------------------- */
+/* R thread                                                              */
+/* --------------------------------------------------------------------- */
+
+/* Must be called with `lock` held */
+
+static void processx__readahead_start() {
+  sigset_t all, old;
+  int ret;
+
+  if (running) return;
+
+  if (processx__readahead_make_pipe(wake_pipe)) {
+    pthread_mutex_unlock(&lock);
+    error("Cannot start processx I/O thread: %s", strerror(errno));
+  }
+
+  /* Signals must go to the R thread, e.g. the SIGCHLD handler assumes
+     this, so we block them all in the I/O thread. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  ret = pthread_create(&thread, NULL, processx__readahead_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (ret) {
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    wake_pipe[0] = wake_pipe[1] = -1;
+    pthread_mutex_unlock(&lock);
+    error("Cannot start processx I/O thread: %s", strerror(ret));
+  }
+
+  running = 1;
+}
+
+/* The spill file is removed right away, so it is deleted when it is
+   closed, even if R crashes. */
+
+static int processx__readahead_spill_file(const char *dir) {
+  char *path = R_alloc(strlen(dir) + 32, 1);
+  int fd;
+  sprintf(path, "%s/processx-spill-XXXXXX", dir);
+  fd = mkstemp(path);
+  if (fd == -1) return -1;
+  unlink(path);
+  processx__cloexec_fcntl(fd, 1);
+  return fd;
+}
+
+void processx__readahead_add(processx_connection_t *ccon, size_t cap,
+			     const char *spill_dir) {
+  processx__readahead_t *ra;
+  const char *encoding = ccon->encoding ? ccon->encoding : "";
+
+  ra = calloc(1, sizeof(processx__readahead_t));
+  if (!ra) error("Cannot allocate memory for processx read-ahead");
+  ra->fd = ccon->handle;
+  ra->cap = cap;
+  ra->spill_fd = -1;
+  if (processx__readahead_make_pipe(ra->notify)) {
+    free(ra);
+    error("Cannot create processx read-ahead: %s", strerror(errno));
+  }
+  ra->iconv_ctx = Riconv_open("UTF-8", encoding);
+  if (ra->iconv_ctx == (void*) -1) {
+    close(ra->notify[0]);
+    close(ra->notify[1]);
+    free(ra);
+    error("Unsupported encoding for processx read-ahead: `%s`", encoding);
+  }
+  if (spill_dir) {
+    ra->spill_fd = processx__readahead_spill_file(spill_dir);
+    if (ra->spill_fd == -1) {
+      int err = errno;
+      close(ra->notify[0]);
+      close(ra->notify[1]);
+      Riconv_close(ra->iconv_ctx);
+      free(ra);
+      error("Cannot create processx spill file in `%s`: %s", spill_dir,
+	    strerror(err));
+    }
+  }
+
+  pthread_mutex_lock(&lock);
+  processx__readahead_start();
+  ra->next = connections;
+  connections = ra;
+  processx__readahead_wake();
+  pthread_mutex_unlock(&lock);
+
+  ccon->readahead = ra;
+}
+
+/* Stop reading the connection, and free the queue. This must be called
+   before the connection's fd is closed. */
+
+void processx__readahead_remove(processx_connection_t *ccon) {
+  processx__readahead_t *ra = ccon->readahead;
+  processx__chunk_t *chunk;
+
+  if (!ra) return;
+
+  pthread_mutex_lock(&lock);
+  if (running) {
+    ra->closing = 1;
+    processx__readahead_wake();
+    while (!ra->removed) pthread_cond_wait(&removed_cond, &lock);
+  } else {
+    processx__readahead_t **prev = &connections;
+    while (*prev && *prev != ra) prev = &(*prev)->next;
+    if (*prev) *prev = ra->next;
+  }
+  pthread_mutex_unlock(&lock);
+
+  while ((chunk = processx__readahead_peek(ccon))) {
+    processx__readahead_pop(ccon);
+  }
+  close(ra->notify[0]);
+  close(ra->notify[1]);
+  if (ra->spill_fd != -1) close(ra->spill_fd);
+  Riconv_close(ra->iconv_ctx);
+  free(ra);
+  ccon->readahead = 0;
+}
+
+/* Whether there are chunks in the queue, or the thread has failed */
+
+/* The spill file must be read up to this offset, before the first
+   chunk of the queue, or up to the end, if the queue is empty. We load
+   `spill_written` first, and every chunk that is pushed after that has
+   a larger offset. */
+
+static off_t processx__readahead_spill_limit(processx__readahead_t *ra) {
+  off_t written = __atomic_load_n(&ra->spill_written, __ATOMIC_ACQUIRE);
+  if (ra->tail != __atomic_load_n(&ra->head, __ATOMIC_ACQUIRE)) {
+    return ra->queue[ra->tail % PROCESSX__READAHEAD_SLOTS]->spill_offset;
+  }
+  return written;
+}
+
+static int processx__readahead_spill_avail(processx__readahead_t *ra) {
+  return ra->spill_fd != -1 &&
+    ra->spill_read < processx__readahead_spill_limit(ra);
+}
+
+int processx__readahead_ready(processx_connection_t *ccon) {
+  processx__readahead_t *ra = ccon->readahead;
+  return ra->tail != __atomic_load_n(&ra->head, __ATOMIC_ACQUIRE) ||
+    processx__readahead_spill_avail(ra) ||
+    __atomic_load_n(&ra->detached, __ATOMIC_ACQUIRE);
+}
+
+/* Whether R needs to read the connection itself, because the thread has
+   failed, and the queue and the spill file are empty. */
+
+int processx__readahead_detached(processx_connection_t *ccon) {
+  processx__readahead_t *ra = ccon->readahead;
+  return __atomic_load_n(&ra->detached, __ATOMIC_ACQUIRE) &&
+    ra->tail == __atomic_load_n(&ra->head, __ATOMIC_ACQUIRE) &&
+    !processx__readahead_spill_avail(ra);
+}
+
+/* The start of an incomplete character, that the thread read, but did
+   not convert. R needs it if it takes over the connection. `buf` has
+   space for eight bytes. */
+
+size_t processx__readahead_carry(processx_connection_t *ccon, char *buf) {
+  processx__readahead_t *ra = ccon->readahead;
+  memcpy(buf, ra->carry, ra->carry_size);
+  return ra->carry_size;
+}
+
+/* The fd to poll, it is readable if there are chunks */
+
+int processx__readahead_fd(processx_connection_t *ccon) {
+  processx__readahead_t *ra = ccon->readahead;
+  return ra->notify[0];
+}
+
+/* The first chunk of the queue, or NULL if there is none. The
+   notification pipe is drained first, so a new chunk will make it
+   readable again. */
+
+processx__chunk_t *processx__readahead_peek(processx_connection_t *ccon) {
+  processx__readahead_t *ra = ccon->readahead;
+  if (ra->tail == __atomic_load_n(&ra->head, __ATOMIC_ACQUIRE)) {
+    processx__drain_pipe(ra->notify[0]);
+    if (ra->tail == __atomic_load_n(&ra->head, __ATOMIC_ACQUIRE)) return 0;
+  }
+  return ra->queue[ra->tail % PROCESSX__READAHEAD_SLOTS];
+}
+
+/* Free the first chunk, and wake up the thread, if it has stopped
+   reading this connection. */
+
+void processx__readahead_pop(processx_connection_t *ccon) {
+  processx__readahead_t *ra = ccon->readahead;
+  processx__chunk_t *chunk = ra->queue[ra->tail % PROCESSX__READAHEAD_SLOTS];
+  size_t size = chunk->size;
+
+  free(chunk);
+  __atomic_store_n(&ra->tail, ra->tail + 1, __ATOMIC_RELEASE);
+  __atomic_sub_fetch(&ra->queued, size, __ATOMIC_SEQ_CST);
+
+  if (__atomic_exchange_n(&ra->throttled, 0, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&lock);
+    if (running) processx__readahead_wake();
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+/* Whether there is spilled data to read before the first chunk */
+
+int processx__readahead_spilled(processx_connection_t *ccon) {
+  return processx__readahead_spill_avail(ccon->readahead);
+}
+
+/* Read from the spill file, at most `size` bytes, and only complete
+   UTF-8 characters. `size` must be at least four. Returns 0 if there is
+   no spilled data to read before the first chunk of the queue. */
+
+ssize_t processx__readahead_spill_read(processx_connection_t *ccon,
+				       char *buf, size_t size) {
+  processx__readahead_t *ra = ccon->readahead;
+  off_t limit;
+  ssize_t n;
+
+  if (ra->spill_fd == -1) return 0;
+  limit = processx__readahead_spill_limit(ra);
+  if (ra->spill_read >= limit) return 0;
+
+  if ((off_t) size > limit - ra->spill_read) size = limit - ra->spill_read;
+  do {
+    n = pread(ra->spill_fd, buf, size, ra->spill_read);
+  } while (n == -1 && errno == EINTR);
+  if (n <= 0) {
+    error("Cannot read processx spill file: %s",
+	  n == 0 ? "unexpected end of file" : strerror(errno));
+  }
+
+  /* The file has complete characters only, but we might have stopped
+     in the middle of one */
+  if (ra->spill_read + n < limit) {
+    ssize_t i = n - 1, len = 1;
+    while (i > 0 && (buf[i] & 0xc0) == 0x80) i--, len++;
+    if ((buf[i] & 0xe0) == 0xc0 && len < 2) n = i;
+    else if ((buf[i] & 0xf0) == 0xe0 && len < 3) n = i;
+    else if ((buf[i] & 0xf8) == 0xf0 && len < 4) n = i;
+  }
+
+  __atomic_store_n(&ra->spill_read, ra->spill_read + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* This is called when the package is unloaded. */
+
+void processx__readahead_stop() {
+  pthread_mutex_lock(&lock);
+  if (!running) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  stopping = 1;
+  processx__readahead_wake();
+  pthread_mutex_unlock(&lock);
+
+  pthread_join(thread, NULL);
+
+  pthread_mutex_lock(&lock);
+  close(wake_pipe[0]);
+  close(wake_pipe[1]);
+  wake_pipe[0] = wake_pipe[1] = -1;
+  running = stopping = 0;
+  connections = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+#endif
@@ -0,0 +1,190 @@
+
+#ifndef _WIN32
+
+#include "../processx.h"
+
+#include <stdio.h>
+
+/* Resource usage of a process.
+ *
+ * If the process has finished, then we report the `struct rusage` that
+ * we got from `wait4()` when reaping it. This is free, we had to reap
+ * it anyway.
+ *
+ * If it is still running, then on Linux we sample `/proc/<pid>/stat`,
+ * `/proc/<pid>/status` and `/proc/<pid>/io`. These are plain file reads,
+ * there is no fork or exec involved. Elsewhere we return `NA`s for a
+ * running process.
+ *
+ * All times are in seconds, all memory sizes and I/O counters are in
+ * bytes. Counters that are not available are `NA`.
+ */
+
+static const char *processx__rusage_names[] = {
+  "live", "user_time", "system_time", "max_rss", "rss",
+  "minor_faults", "major_faults", "voluntary_switches",
+  "involuntary_switches", "read_bytes", "write_bytes", "read_chars",
+  "write_chars", "" };
+
+#define PROCESSX__RUSAGE_FIELDS 12
+
+typedef struct {
+  double values[PROCESSX__RUSAGE_FIELDS];
+} processx__rusage_t;
+
+#define PXRU_USER_TIME      0
+#define PXRU_SYSTEM_TIME    1
+#define PXRU_MAX_RSS        2
+#define PXRU_RSS            3
+#define PXRU_MINOR_FAULTS   4
+#define PXRU_MAJOR_FAULTS   5
+#define PXRU_VOLUNTARY      6
+#define PXRU_INVOLUNTARY    7
+#define PXRU_READ_BYTES     8
+#define PXRU_WRITE_BYTES    9
+#define PXRU_READ_CHARS    10
+#define PXRU_WRITE_CHARS   11
+
+static double processx__timeval_secs(struct timeval *tv) {
+  return (double) tv->tv_sec + (double) tv->tv_usec / 1000000.0;
+}
+
+static void processx__rusage_from_struct(struct rusage *ru,
+					 processx__rusage_t *res) {
+  res->values[PXRU_USER_TIME]    = processx__timeval_secs(&ru->ru_utime);
+  res->values[PXRU_SYSTEM_TIME]  = processx__timeval_secs(&ru->ru_stime);
+#ifdef __APPLE__
+  /* macOS reports bytes, everyone else kilobytes */
+  res->values[PXRU_MAX_RSS]      = (double) ru->ru_maxrss;
+#else
+  res->values[PXRU_MAX_RSS]      = (double) ru->ru_maxrss * 1024.0;
+#endif
+  res->values[PXRU_MINOR_FAULTS] = (double) ru->ru_minflt;
+  res->values[PXRU_MAJOR_FAULTS] = (double) ru->ru_majflt;
+  res->values[PXRU_VOLUNTARY]    = (double) ru->ru_nvcsw;
+  res->values[PXRU_INVOLUNTARY]  = (double) ru->ru_nivcsw;
+  /* Block counts are in 512 byte units */
+  res->values[PXRU_READ_BYTES]   = (double) ru->ru_inblock * 512.0;
+  res->values[PXRU_WRITE_BYTES]  = (double) ru->ru_oublock * 512.0;
+}
+
+#ifdef __linux__
+
+static int processx__read_proc_file(pid_t pid, const char *what,
+				    char *buf, size_t size) {
+  char path[64];
+  int fd;
+  ssize_t n, all = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/%s", (int) pid, what);
+  do { fd = open(path, O_RDONLY); } while (fd == -1 && errno == EINTR);
+  if (fd == -1) return -1;
+
+  while (all < size - 1) {
+    do {
+      n = read(fd, buf + all, size - 1 - all);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) break;
+    all += n;
+  }
+  close(fd);
+
+  buf[all] = '\0';
+  return n == -1 ? -1 : 0;
+}
+
+static double processx__proc_field(const char *buf, const char *key) {
+  const char *ptr = strstr(buf, key);
+  double value;
+  if (!ptr) return NA_REAL;
+  ptr += strlen(key);
+  if (sscanf(ptr, " %lf", &value) != 1) return NA_REAL;
+  return value;
+}
+
+static int processx__rusage_from_proc(pid_t pid, processx__rusage_t *res) {
+  char buf[4096];
+  const char *ptr;
+  unsigned long minflt, majflt, utime, stime;
+  long rss;
+  double ticks = (double) sysconf(_SC_CLK_TCK);
+  double pagesize = (double) sysconf(_SC_PAGESIZE);
+
+  if (processx__read_proc_file(pid, "stat", buf, sizeof(buf))) return -1;
+
+  /* The command name might contain spaces and parens, so we skip to
+     the last closing paren, then field 3 (state) follows. */
+  ptr = strrchr(buf, ')');
+  if (!ptr) return -1;
+  if (sscanf(ptr + 2,
+	     "%*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu "
+	     "%*d %*d %*d %*d %*d %*d %*u %*u %ld",
+	     &minflt, &majflt, &utime, &stime, &rss) != 5) {
+    return -1;
+  }
+
+  res->values[PXRU_USER_TIME]    = utime / ticks;
+  res->values[PXRU_SYSTEM_TIME]  = stime / ticks;
+  res->values[PXRU_RSS]          = rss * pagesize;
+  res->values[PXRU_MINOR_FAULTS] = (double) minflt;
+  res->values[PXRU_MAJOR_FAULTS] = (double) majflt;
+
+  /* These are optional, we keep the NAs if we cannot read them. */
+  if (!processx__read_proc_file(pid, "status", buf, sizeof(buf))) {
+    res->values[PXRU_MAX_RSS] = processx__proc_field(buf, "VmHWM:") * 1024.0;
+    res->values[PXRU_VOLUNTARY] =
+      processx__proc_field(buf, "\nvoluntary_ctxt_switches:");
+    res->values[PXRU_INVOLUNTARY] =
+      processx__proc_field(buf, "nonvoluntary_ctxt_switches:");
+  }
+
+  if (!processx__read_proc_file(pid, "io", buf, sizeof(buf))) {
+    res->values[PXRU_READ_CHARS]  = processx__proc_field(buf, "rchar:");
+    res->values[PXRU_WRITE_CHARS] = processx__proc_field(buf, "wchar:");
+    res->values[PXRU_READ_BYTES]  = processx__proc_field(buf, "read_bytes:");
+    res->values[PXRU_WRITE_BYTES] =
+      processx__proc_field(buf, "\nwrite_bytes:");
+  }
+
+  return 0;
+}
+
+#endif
+
+SEXP processx_get_resource_usage(SEXP status) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  processx__rusage_t res;
+  int i, live = 0;
+  SEXP result, names;
+
+  if (!handle) error("Internal processx error, handle already removed");
+
+  for (i = 0; i < PROCESSX__RUSAGE_FIELDS; i++) res.values[i] = NA_REAL;
+
+  processx__drain_exits();
+
+  if (handle->collected) {
+    processx__rusage_from_struct(&handle->rusage, &res);
+  } else {
+#ifdef __linux__
+    live = processx__rusage_from_proc(handle->pid, &res) == 0;
+#else
+    live = 1;
+#endif
+  }
+
+  result = PROTECT(allocVector(VECSXP, PROCESSX__RUSAGE_FIELDS + 1));
+  names = PROTECT(allocVector(STRSXP, PROCESSX__RUSAGE_FIELDS + 1));
+  SET_VECTOR_ELT(result, 0, ScalarLogical(live));
+  SET_STRING_ELT(names, 0, mkChar(processx__rusage_names[0]));
+  for (i = 0; i < PROCESSX__RUSAGE_FIELDS; i++) {
+    SET_VECTOR_ELT(result, i + 1, ScalarReal(res.values[i]));
+    SET_STRING_ELT(names, i + 1, mkChar(processx__rusage_names[i + 1]));
+  }
+  setAttrib(result, R_NamesSymbol, names);
+
+  UNPROTECT(2);
+  return result;
+}
+
+#endif
@@ -0,0 +1,294 @@
+
+#ifndef _WIN32
+
+/* For memfd_create() */
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include "../processx.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#endif
+
+#include <stdio.h>
+
+/* Shared memory output channel
+ *
+ * See `processx-shm.h` for the protocol. Here we create the channel in
+ * the parent, before the fork, and implement the reader side of it.
+ *
+ * There are two mappings of the shared memory in the parent. One belongs
+ * to the process handle, we use it to mark the ring as closed when the
+ * process exits. (This happens when the exit status is collected, and
+ * the connection might be finalized already by then.) The other one
+ * belongs to the connection, and it is used for reading. Similarly, the
+ * handle and the connection have their own copies of the eventfd.
+ */
+
+#ifdef __linux__
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+static int processx__memfd_create(const char *name) {
+#ifdef SYS_memfd_create
+  return syscall(SYS_memfd_create, name, MFD_CLOEXEC);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static void *processx__shm_map(int memfd, size_t size) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   memfd, 0);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+#endif
+
+/* Called before the fork. It creates the shared memory, maps it into the
+   handle, and creates the eventfd. The memfd is returned, it is needed
+   until the fork, to create the second mapping for the connection.
+   Both fds are close-on-exec, the child clears this flag. */
+
+int processx__shm_create(processx_handle_t *handle, size_t size) {
+#ifdef __linux__
+  int memfd;
+  size_t map_size = sizeof(processx_shm_header_t) + size;
+  processx_shm_header_t *hdr;
+
+  memfd = processx__memfd_create("processx-shm");
+  if (memfd == -1) {
+    error("Cannot create shared memory for processx: %s", strerror(errno));
+  }
+
+  if (ftruncate(memfd, map_size)) {
+    close(memfd);
+    error("Cannot allocate shared memory for processx: %s",
+	  strerror(errno));
+  }
+
+  hdr = processx__shm_map(memfd, map_size);
+  if (!hdr) {
+    close(memfd);
+    error("Cannot map shared memory for processx: %s", strerror(errno));
+  }
+
+  memset(hdr, 0, sizeof(processx_shm_header_t));
+  hdr->magic = PROCESSX_SHM_MAGIC;
+  hdr->version = PROCESSX_SHM_VERSION;
+  hdr->size = size;
+
+  handle->shm_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (handle->shm_eventfd == -1) {
+    munmap(hdr, map_size);
+    close(memfd);
+    error("Cannot create eventfd for processx: %s", strerror(errno));
+  }
+
+  handle->shm_hdr = hdr;
+  handle->shm_map_size = map_size;
+
+  return memfd;
+
+#else
+  error("Shared memory channels are only supported on Linux");
+  return -1;
+#endif
+}
+
+/* Environment for the child, with PROCESSX_SHM added. We create this in
+   the parent, so the child does not need to allocate memory. */
+
+char **processx__shm_environ(int memfd, int eventfd) {
+  extern char **environ;
+  size_t i, n = 0, len = strlen(PROCESSX_SHM_ENVVAR);
+  char **env;
+  char *var;
+
+  while (environ[n]) n++;
+  env = (char**) R_alloc(n + 2, sizeof(char*));
+  var = R_alloc(len + 64, 1);
+  snprintf(var, len + 64, "%s=%d,%d", PROCESSX_SHM_ENVVAR, memfd, eventfd);
+
+  for (i = 0, n = 0; environ[i]; i++) {
+    if (!strncmp(environ[i], PROCESSX_SHM_ENVVAR, len) &&
+	environ[i][len] == '=') continue;
+    env[n++] = environ[i];
+  }
+  env[n++] = var;
+  env[n] = NULL;
+
+  return env;
+}
+
+/* Called after the fork, in the parent. It creates the connection, with
+   its own mapping and its own eventfd. */
+
+void processx__shm_create_connection(processx_handle_t *handle, int memfd,
+				     SEXP private, const char *encoding) {
+#ifdef __linux__
+  processx_connection_t *con;
+  SEXP res;
+  void *ptr;
+  int fd;
+
+  ptr = processx__shm_map(memfd, handle->shm_map_size);
+  close(memfd);
+  if (!ptr) {
+    error("Cannot map shared memory for processx: %s", strerror(errno));
+  }
+
+  fd = fcntl(handle->shm_eventfd, F_DUPFD_CLOEXEC, 0);
+  if (fd == -1) {
+    munmap(ptr, handle->shm_map_size);
+    error("Cannot create processx connection: %s", strerror(errno));
+  }
+
+  con = processx_c_connection_create(fd, PROCESSX_FILE_TYPE_SHMRING,
+				     encoding, &res);
+  con->shm = ptr;
+  con->shm_map_size = handle->shm_map_size;
+  handle->shm = con;
+
+  defineVar(install("shm_pipe"), res, private);
+#endif
+}
+
+/* Called on the main thread, when we collect the exit status of the
+   process, see `processx__collect_exit_status()`. `processx_poll()`
+   drains the exit queue when the SIGCHLD handler notifies it, so a
+   reader that only polls the channel sees the EOF as well. */
+
+void processx__shm_writer_exited(processx_handle_t *handle) {
+  uint64_t one = 1;
+  ssize_t ret;
+  if (!handle->shm_hdr) return;
+  processx_shm_close(handle->shm_hdr);
+  ret = write(handle->shm_eventfd, &one, sizeof(one));
+  (void) ret;
+}
+
+void processx__shm_destroy(processx_handle_t *handle) {
+#ifdef __linux__
+  if (handle->shm_hdr) munmap(handle->shm_hdr, handle->shm_map_size);
+  if (handle->shm_eventfd >= 0) close(handle->shm_eventfd);
+  handle->shm_hdr = NULL;
+  handle->shm_eventfd = -1;
+#endif
+}
+
+/* -------------------------------------------------------------------- */
+/* Reader side                                                          */
+/* -------------------------------------------------------------------- */
+
+/* Whether a read would return something, data or EOF. No system calls. */
+
+int processx__shm_ready(processx_connection_t *ccon) {
+  processx_shm_header_t *hdr = ccon->shm;
+  if (!hdr) return 0;
+  if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE)) return 1;
+  return __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) != hdr->tail;
+}
+
+/* Reset the eventfd, it is non-blocking, so this does not block if it
+   is already zero. */
+
+static void processx__shm_clear_event(processx_connection_t *ccon) {
+  uint64_t counter;
+  ssize_t ret;
+  do {
+    ret = read(ccon->handle, &counter, sizeof(counter));
+  } while (ret == -1 && errno == EINTR);
+  if (ret == -1 && errno != EAGAIN) {
+    error("Cannot read processx shared memory event: %s", strerror(errno));
+  }
+}
+
+/* Contiguous readable part of the ring. Returns 1 if there is data,
+   0 if not, but more might come, and -1 on EOF.
+
+   The eventfd is only cleared if the ring is empty, i.e. when the
+   reader is about to poll it. After clearing it we look at the ring
+   again, so we don't miss data that was added before the notification
+   that we cleared. While there is data, peeking needs no system calls. */
+
+int processx__shm_peek(processx_connection_t *ccon, const char **ptr,
+		       size_t *nbyte) {
+  processx_shm_header_t *hdr = ccon->shm;
+  uint64_t head, tail = hdr->tail;
+  size_t pos, avail;
+  int closed;
+
+  /* `closed` first: if it is set, then `head` is final. */
+  closed = __atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE);
+  head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+  if (head == tail && !closed) {
+    processx__shm_clear_event(ccon);
+    closed = __atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+  }
+
+  if (head == tail) {
+    *nbyte = 0;
+    return closed ? -1 : 0;
+  }
+
+  pos = tail % hdr->size;
+  avail = head - tail;
+  if (avail > hdr->size - pos) avail = hdr->size - pos;
+
+  *ptr = PROCESSX_SHM_DATA(hdr) + pos;
+  *nbyte = avail;
+  return 1;
+}
+
+void processx__shm_consume(processx_connection_t *ccon, size_t nbyte) {
+  processx_shm_header_t *hdr = ccon->shm;
+  __atomic_store_n(&hdr->tail, hdr->tail + nbyte, __ATOMIC_RELEASE);
+}
+
+/* This has the same semantics as `read()` on a non-blocking fd, so the
+   connection code can use it in place of `read()`. */
+
+ssize_t processx__shm_read(processx_connection_t *ccon, void *buf,
+			   size_t nbyte) {
+  size_t done = 0;
+
+  while (done < nbyte) {
+    const char *ptr;
+    size_t avail;
+    int ret = processx__shm_peek(ccon, &ptr, &avail);
+    if (ret == -1 && done == 0) return 0;
+    if (ret != 1) break;
+    if (avail > nbyte - done) avail = nbyte - done;
+    memcpy((char*) buf + done, ptr, avail);
+    processx__shm_consume(ccon, avail);
+    done += avail;
+  }
+
+  if (done == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  return done;
+}
+
+void processx__shm_unmap(processx_connection_t *ccon) {
+#ifdef __linux__
+  if (ccon->shm) munmap(ccon->shm, ccon->shm_map_size);
+  ccon->shm = NULL;
+#endif
+}
+
+#endif
@@ -1,70 +1,397 @@
-
 #include "../processx.h"
 
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
 extern processx__child_list_t *child_list;
 
+/* Exit queue
+ *
+ * The SIGCHLD handler does as little as possible. It reaps the children
+ * that have exited, pushes their exit status into a preallocated, single
+ * producer, single consumer ring buffer, and writes a byte into the
+ * notification pipe. It does not touch R objects, and it does not change
+ * the child list, other than marking the reaped children.
+ *
+ * The main thread drains the queue, see `processx__drain_exits()`, and
+ * does all the bookkeeping: it fills the handles, and removes the
+ * children from the child list. So the API functions do not need to
+ * block SIGCHLD, only fork(), freeing list nodes, and the (rare) case of
+ * a full queue do.
+ *
+ * The handler is the only producer. The main thread is the only
+ * consumer, except when it reaps with SIGCHLD blocked, and then the
+ * handler cannot run.
+ */
+
+typedef struct {
+  processx__child_list_t *child;
+  int wstat;
+  struct rusage rusage;
+} processx__exit_t;
+
+#define PROCESSX__EXIT_QUEUE_SIZE 256
+
+static processx__exit_t exit_queue[PROCESSX__EXIT_QUEUE_SIZE];
+static unsigned int exit_queue_head = 0; /* written by the producer */
+static unsigned int exit_queue_tail = 0; /* written by the consumer */
+static volatile sig_atomic_t exit_queue_full = 0;
+
+/* When we last checked our handler, see `processx__check_sigchld()` */
+
+#define PROCESSX__SIGCHLD_CHECK 0.1
+
+static double sigchld_checked = -1;
+
+/* Notification pipe for waiting on processes, see `processx_wait()` and
+   unix/wait.c. We write a byte into it, after reaping some children. */
+
+int processx__notify_pipe[2] = { -1, -1 };
+
+/* Subreaper mode, Linux only
+ *
+ * R is a child subreaper, so the orphaned descendants of our children
+ * are reparented to R, instead of init. They are in the process group
+ * of our child, unless they created their own. We keep these process
+ * groups in a fixed table, and the SIGCHLD handler reaps their members
+ * with `wait4(-pgid)`. A group stays in the table until it has no
+ * members left that are our children. The main thread adds groups with
+ * a compare-and-swap, the handler clears them the same way.
+ *
+ * Orphans that started their own session or process group are not
+ * reaped, and neither are the orphaned children of processes that were
+ * not started by processx, e.g. by `system()`. These stay zombies until
+ * R exits.
+ */
+
+#define PROCESSX__SUBREAPER_GROUPS 1024
+
+static pid_t subreaper_groups[PROCESSX__SUBREAPER_GROUPS];
+static int subreaper_on = 0;
+
+void processx__exit_queue_reset() {
+  exit_queue_head = exit_queue_tail = 0;
+  exit_queue_full = 0;
+  sigchld_checked = -1;
+  memset(subreaper_groups, 0, sizeof(subreaper_groups));
+#ifdef __linux__
+  /* Unloading, nobody would reap the orphans any more */
+  if (subreaper_on) prctl(PR_SET_CHILD_SUBREAPER, 0);
+#endif
+  subreaper_on = 0;
+}
+
+void processx__subreaper_init() {
+#ifdef __linux__
+  if (subreaper_on) return;
+  if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+    error("Cannot make R a child subreaper: %s", strerror(errno));
+  }
+  subreaper_on = 1;
+#else
+  error("Subreaper mode is only supported on Linux");
+#endif
+}
+
+/* If the table is full, then the orphans of this group are not reaped,
+   but the child itself is, like any other child. */
+
+void processx__subreaper_add(pid_t pgid) {
+  int i;
+  for (i = 0; i < PROCESSX__SUBREAPER_GROUPS; i++) {
+    pid_t empty = 0;
+    if (__atomic_compare_exchange_n(&subreaper_groups[i], &empty, pgid, 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return;
+    }
+  }
+}
+
 void processx__sigchld_callback(int sig, siginfo_t *info, void *ctx) {
+  int saved_errno = errno;
   if (sig != SIGCHLD) return;
 
+  processx__stats.sigchld++;
+
+  if (processx__reap_children() > 0 && processx__notify_pipe[1] >= 0) {
+    /* If the pipe is full, then the reader has a notification already */
+    ssize_t ret = write(processx__notify_pipe[1], "x", 1);
+    (void) ret;
+  }
+
+  PROCESSX_TRACE2(sigchld, processx__stats.sigchld,
+		  processx__stats.sigchld_waits);
+
+  errno = saved_errno;
+}
+
+/* Push an exit status to the queue, the caller checked that there is
+   space for it. */
+
+static void processx__exit_push(processx__child_list_t *child, int wstat,
+				struct rusage *ru) {
+  unsigned int head = exit_queue_head;
+  processx__exit_t *exit = &exit_queue[head % PROCESSX__EXIT_QUEUE_SIZE];
+  child->reaped = 1;
+  exit->child = child;
+  exit->wstat = wstat;
+  exit->rusage = *ru;
+  __atomic_store_n(&exit_queue_head, head + 1, __ATOMIC_RELEASE);
+  PROCESSX_TRACE2(reap, child->pid, wstat);
+}
+
+static int processx__reap_groups();
+
+/* Reap the children that have exited, push them to the exit queue, and
+   return their number. This is called from the SIGCHLD handler, or with
+   SIGCHLD blocked. */
+
+int processx__reap_children() {
+  int reaped = 0;
+
   /* While we get a pid in info, this is basically useless, as
      (on some platforms at least) a single signal might be delivered
      for multiple children exiting around the same time. So we need to
      iterate over all children to see which one has exited. */
 
-  processx__child_list_t *ptr = child_list->next;
-  processx__child_list_t *prev = child_list;
+  processx__child_list_t *ptr =
+    __atomic_load_n(&child_list->next, __ATOMIC_ACQUIRE);
 
   while (ptr) {
-    processx__child_list_t *next = ptr->next;
+    unsigned int head = exit_queue_head;
     int wp, wstat;
+    struct rusage ru;
+
+    /* Reaped already, but the main thread did not see it yet */
+    if (ptr->reaped) goto next;
+
+    /* No space for it, the main thread will reap it after draining */
+    if (head - __atomic_load_n(&exit_queue_tail, __ATOMIC_ACQUIRE) ==
+	PROCESSX__EXIT_QUEUE_SIZE) {
+      exit_queue_full = 1;
+      break;
+    }
 
     /* Check if this child has exited */
     do {
-      wp = waitpid(ptr->pid, &wstat, WNOHANG);
+      wp = wait4(ptr->pid, &wstat, WNOHANG, &ru);
+      processx__stats.sigchld_waits++;
     } while (wp == -1 && errno == EINTR);
 
-    if (wp <= 0) {
-      /* If it is still running (or an error happened), we do nothing */
-      prev = ptr;
-      ptr = next;
+    /* If it is still running (or an error happened), we do nothing.
+       E.g. ECHILD means that the main thread reaped it. */
+    if (wp > 0) {
+      processx__exit_push(ptr, wstat, &ru);
+      reaped++;
+    }
+
+  next:
+    ptr = __atomic_load_n(&ptr->next, __ATOMIC_ACQUIRE);
+  }
+
+  if (subreaper_on) reaped += processx__reap_groups();
 
-    } else {
-      /* Remove the child from the list */
+  return reaped;
+}
+
+/* The child that is not reaped yet, or NULL. Called from the handler. */
+
+static processx__child_list_t *processx__child_find_running(pid_t pid) {
+  processx__child_list_t *ptr =
+    __atomic_load_n(&child_list->next, __ATOMIC_ACQUIRE);
+  while (ptr) {
+    if (ptr->pid == pid && !ptr->reaped) return ptr;
+    ptr = __atomic_load_n(&ptr->next, __ATOMIC_ACQUIRE);
+  }
+  return NULL;
+}
 
-      /* We deliberately do not call the finalizer here, because that
+/* Reap the members of the subreaper process groups. A member is either
+   our child, and then it goes to the exit queue, or an adopted orphan,
+   and then we just count it. Returns the number of queued children. */
+
+static int processx__reap_groups() {
+  int i, reaped = 0;
+
+  for (i = 0; i < PROCESSX__SUBREAPER_GROUPS; i++) {
+    pid_t pgid = __atomic_load_n(&subreaper_groups[i], __ATOMIC_ACQUIRE);
+    if (!pgid) continue;
+
+    while (1) {
+      int wp, wstat;
+      struct rusage ru;
+
+      /* We might reap a child, so we need space for it in the queue */
+      if (exit_queue_head - __atomic_load_n(&exit_queue_tail,
+					    __ATOMIC_ACQUIRE) ==
+	  PROCESSX__EXIT_QUEUE_SIZE) {
+	exit_queue_full = 1;
+	return reaped;
+      }
+
+      do {
+	wp = wait4(-pgid, &wstat, WNOHANG, &ru);
+	processx__stats.sigchld_waits++;
+      } while (wp == -1 && errno == EINTR);
+
+      if (wp > 0) {
+	processx__child_list_t *child = processx__child_find_running(wp);
+	if (child) {
+	  processx__exit_push(child, wstat, &ru);
+	  reaped++;
+	} else {
+	  processx__stats.orphans++;
+	  PROCESSX_TRACE2(reap, wp, wstat);
+	}
+	continue;
+      }
+
+      /* No members left. But right after fork() the child might not be
+	 in its own group yet, so we keep the group while it is alive. */
+      if (wp == -1 && errno == ECHILD && !processx__child_find_running(pgid)) {
+	__atomic_compare_exchange_n(&subreaper_groups[i], &pgid, 0, 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+      }
+      break;
+    }
+  }
+
+  return reaped;
+}
+
+/* Reap on the main thread. This is needed if the queue was full, and
+   also if SIGCHLD is not delivered at all, e.g. in valgrind. */
+
+void processx__poll_children() {
+  processx__block_sigchld();
+  processx__reap_children();
+  processx__unblock_sigchld();
+}
+
+/* Our handler might be replaced by another package, and then we miss
+   exits. Checking the handler needs a system call, so we only do it
+   every PROCESSX__SIGCHLD_CHECK seconds, and then we also reap on the
+   main thread, in case SIGCHLD is not delivered at all, e.g. in
+   valgrind. Between the checks the exit queue is up to date, so the
+   queries can answer without any system calls. */
+
+void processx__check_sigchld() {
+  double now = processx__now();
+  struct sigaction old;
+
+  if (sigchld_checked >= 0 &&
+      now - sigchld_checked < PROCESSX__SIGCHLD_CHECK) return;
+
+  if (sigaction(SIGCHLD, NULL, &old) == -1 ||
+      !(old.sa_flags & SA_SIGINFO) ||
+      old.sa_sigaction != processx__sigchld_callback) {
+    processx__setup_sigchld();
+  }
+
+  processx__poll_children();
+  sigchld_checked = now;
+}
+
+/* Whether the process has exited, with the exit status collected. This
+   is the fast path of the queries, see above. */
+
+int processx__child_exited(SEXP status) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  processx__drain_exits();
+  if (!handle->collected) {
+    processx__check_sigchld();
+    processx__drain_exits();
+  }
+  return handle->collected;
+}
+
+/* Process the exit queue, on the main thread. Returns the number of
+   exited children. */
+
+int processx__drain_exits() {
+  int drained = 0;
+
+  while (1) {
+    unsigned int tail = exit_queue_tail;
+
+    while (tail != __atomic_load_n(&exit_queue_head, __ATOMIC_ACQUIRE)) {
+      processx__exit_t *exit = &exit_queue[tail % PROCESSX__EXIT_QUEUE_SIZE];
+      processx__child_list_t *child = exit->child;
+
+      /* If the finalizer ran already, then there is no handle any more.
+	 We deliberately do not call the finalizer here, because that
 	 moves the exit code and pid to R, and we might have just checked
-	 that these are not in R, before calling C. So finalizing here
-	 would be a race condition.
-
-	 OTOH, we need to check if the handle is null, because a finalizer
-	 might actually run before the SIGCHLD handler. Or the finalizer
-	 might even trigger the SIGCHLD handler...
-      */
-
-      processx_handle_t *handle = R_ExternalPtrAddr(ptr->status);
-
-      /* If handle is NULL, then the exit status was collected already */
-      if (handle) processx__collect_exit_status(ptr->status, wstat);
-
-      /* Defer freeing the memory, because malloc/free are typically not
-	 reentrant, and if we free in the SIGCHLD handler, that can cause
-	 crashes. The test case in test-run.R (see comments there)
-	 typically brings this out. */
-      memset(ptr, 0, sizeof(*ptr));
-      processx__freelist_add(ptr);
-
-      /* If there is an active wait() with a timeout, then stop it */
-      if (handle && handle->waitpipe[1] >= 0) {
-	close(handle->waitpipe[1]);
-	handle->waitpipe[1] = -1;
+	 that these are not in R, before calling C. */
+      if (child->status && R_ExternalPtrAddr(child->status)) {
+	processx__collect_exit_status(child->status, exit->wstat,
+				      &exit->rusage);
       }
 
-      /* If we remove the current list node, then prev stays the same,
-	 we only need to update ptr. */
-      prev->next = next;
-      ptr = next;
+      /* Release the slot, the handler may reuse it now */
+      __atomic_store_n(&exit_queue_tail, ++tail, __ATOMIC_RELEASE);
+
+      processx__child_remove(child);
+      drained++;
     }
+
+    if (!exit_queue_full) break;
+    exit_queue_full = 0;
+    processx__poll_children();
+  }
+
+  return drained;
+}
+
+/* Reap a single child on the main thread, e.g. after killing it. Returns
+   the same as `wait4()`. If the SIGCHLD handler was faster, then we get
+   ECHILD, and the exit status is in the queue already. */
+
+pid_t processx__wait_child(SEXP status, int options) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  pid_t wp;
+  int wstat, saved_errno;
+  struct rusage ru;
+
+  do {
+    wp = wait4(handle->pid, &wstat, options, &ru);
+  } while (wp == -1 && errno == EINTR);
+
+  if (wp == handle->pid) {
+    /* The handler will get ECHILD for it now, until we remove it */
+    processx__child_list_t *child = processx__child_find_status(status);
+    processx__collect_exit_status(status, wstat, &ru);
+    if (child) processx__child_remove(child);
+
+  } else if (wp == -1 && errno == ECHILD) {
+    saved_errno = errno;
+    processx__drain_exits();
+    if (handle->collected) return handle->pid;
+    errno = saved_errno;
   }
+
+  return wp;
+}
+
+void processx__notify_init() {
+  int fds[2];
+  if (processx__notify_pipe[0] >= 0) return;
+  if (pipe(fds)) error("processx error: %s", strerror(errno));
+  processx__cloexec_fcntl(fds[0], 1);
+  processx__cloexec_fcntl(fds[1], 1);
+  processx__nonblock_fcntl(fds[0], 1);
+  processx__nonblock_fcntl(fds[1], 1);
+  /* The handler only looks at the write end */
+  processx__notify_pipe[0] = fds[0];
+  __atomic_store_n(&processx__notify_pipe[1], fds[1], __ATOMIC_RELEASE);
+}
+
+void processx__notify_drain() {
+  char buf[256];
+  ssize_t ret;
+  do {
+    ret = read(processx__notify_pipe[0], buf, sizeof(buf));
+  } while (ret > 0 || (ret == -1 && errno == EINTR));
 }
 
 /* TODO: use oldact */
@@ -18,6 +18,20 @@ char **processx__tmp_character(SEXP chr) {
   return cchr;
 }
 
+/* Look up a list element by name, R_NilValue if there is no such
+   element. */
+
+SEXP processx__list_elt(SEXP list, const char *name) {
+  SEXP names = getAttrib(list, R_NamesSymbol);
+  int i, n = isNull(list) ? 0 : LENGTH(list);
+  for (i = 0; i < n; i++) {
+    if (!strcmp(CHAR(STRING_ELT(names, i)), name)) {
+      return VECTOR_ELT(list, i);
+    }
+  }
+  return R_NilValue;
+}
+
 int processx__nonblock_fcntl(int fd, int set) {
   int flags;
   int r;
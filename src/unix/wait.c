@@ -0,0 +1,115 @@
+
+#ifndef _WIN32
+
+#include "../processx.h"
+
+/* Waiting on many processes at once
+ *
+ * There is a single notification pipe for all processes. The SIGCHLD
+ * handler reaps the children that have exited, queues their exit status,
+ * and writes a byte into the pipe. So we only need to poll the pipe,
+ * drain the exit queue, and then look at the `collected` flags of the
+ * handles, no system calls per process.
+ *
+ * To avoid missing a notification, we drain the pipe before the queue.
+ * If a child exits after that, then the pipe will be readable when we
+ * poll it.
+ */
+
+static int processx__wait_many_done(processx_handle_t **handles, int n,
+				    int all) {
+  int i, done = 0;
+  for (i = 0; i < n; i++) done += handles[i]->collected;
+  return all ? done == n : (done > 0 || n == 0);
+}
+
+/* Wait until all (or any) of the handles have an exit status, or the
+   timeout (in ms, -1 is no timeout) is over. Returns whether they
+   finished. */
+
+int processx__wait_handles(processx_handle_t **handles, int n, int all,
+			   int timeout) {
+  double start = processx__now();
+  struct pollfd fd;
+
+  /* Make sure this is active, in case another package replaced it... */
+  processx__check_sigchld();
+  processx__notify_init();
+
+  fd.fd = processx__notify_pipe[0];
+  fd.events = POLLIN;
+
+  while (1) {
+    int ret, wait = PROCESSX_INTERRUPT_INTERVAL;
+
+    processx__notify_drain();
+    processx__drain_exits();
+    if (processx__wait_many_done(handles, n, all)) return 1;
+
+    if (timeout >= 0) {
+      int timeleft = timeout - (processx__now() - start) * 1000;
+      if (timeleft <= 0) return 0;
+      if (timeleft < wait) wait = timeleft;
+    }
+
+    fd.revents = 0;
+    do {
+      ret = poll(&fd, 1, wait);
+      processx__stats.poll_wakeups++;
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+      error("processx wait error: %s", strerror(errno));
+    }
+
+    if (ret == 0) {
+      R_CheckUserInterrupt();
+      /* SIGCHLD is not delivered in valgrind, so we reap after a timeout
+	 as well */
+      processx__poll_children();
+    }
+  }
+}
+
+/* Returns the exit codes, or NA for the processes that are still
+   running. With `all` it returns after all of them have finished,
+   otherwise after the first one. */
+
+SEXP processx_wait_many(SEXP statuses, SEXP timeout, SEXP all) {
+  int i, n = LENGTH(statuses);
+  int ctimeout = INTEGER(timeout)[0], call = LOGICAL(all)[0];
+  processx_handle_t **handles;
+  SEXP result;
+
+  handles = (processx_handle_t**) R_alloc(n, sizeof(processx_handle_t*));
+  for (i = 0; i < n; i++) {
+    handles[i] = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+    if (!handles[i]) error("Internal processx error, handle already removed");
+  }
+
+  processx__wait_handles(handles, n, call, ctimeout);
+
+  result = PROTECT(allocVector(INTSXP, n));
+  for (i = 0; i < n; i++) {
+    INTEGER(result)[i] =
+      handles[i]->collected ? handles[i]->exitcode : NA_INTEGER;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* A pollable for the notification pipe, so `processx_poll()` wakes up
+   when a child exits. We drain the pipe and the exit queue first, so
+   the pollables after this one see the new exit statuses, e.g. a closed
+   shared memory channel. */
+
+int processx__poll_func_exits(void *object, int status, int *handle,
+			      int *again) {
+  processx__notify_drain();
+  processx__drain_exits();
+  if (handle) *handle = processx__notify_pipe[0];
+  if (again) *again = 0;
+  return PXSILENT;
+}
+
+#endif
@@ -13,6 +13,10 @@ typedef struct processx_handle_s {
   HANDLE waitObject;
   processx_connection_t *pipes[3];
   int cleanup;
+  double deadline;		/* monotonic time, see processx_set_deadline() */
+  double deadline_grace;	/* SIGKILL this long after SIGTERM */
+  double killed_at;		/* when the deadline killed it, or 0 */
+  int deadline_state;		/* PROCESSX_DEADLINE_* */
 } processx_handle_t;
 
 extern HANDLE processx__iocp;
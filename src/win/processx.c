@@ -622,7 +622,7 @@ void processx__handle_destroy(processx_handle_t *handle) {
 
 SEXP processx_exec(SEXP command, SEXP args, SEXP std_out, SEXP std_err,
 		   SEXP windows_verbatim_args, SEXP windows_hide,
-		   SEXP private, SEXP cleanup, SEXP encoding) {
+		   SEXP private, SEXP cleanup, SEXP encoding, SEXP unix_options) {
 
   const char *cstd_out = isNull(std_out) ? 0 : CHAR(STRING_ELT(std_out, 0));
   const char *cstd_err = isNull(std_err) ? 0 : CHAR(STRING_ELT(std_err, 0));
@@ -641,6 +641,7 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP std_out, SEXP std_err,
   int ccleanup = INTEGER(cleanup)[0];
   SEXP result;
   DWORD dwerr;
+  double start_time = processx__now();
 
   options.windows_verbatim_args = LOGICAL(windows_verbatim_args)[0];
   options.windows_hide = LOGICAL(windows_hide)[0];
@@ -785,6 +786,9 @@ SEXP processx_exec(SEXP command, SEXP args, SEXP std_out, SEXP std_err,
   processx__stdio_destroy(handle->child_stdio_buffer);
   handle->child_stdio_buffer = NULL;
 
+  processx__stats.spawns++;
+  processx__stats.spawn_time += processx__now() - start_time;
+
   UNPROTECT(1);
   return result;
 }
@@ -830,11 +834,93 @@ SEXP processx_wait(SEXP status, SEXP timeout) {
   return ScalarLogical(TRUE);
 }
 
-SEXP processx_is_alive(SEXP status) {
+/* Wait for the first one, or all of `statuses` to finish. Returns the
+   exit codes, NA for the running processes. WaitForMultipleObjects()
+   can wait on at most MAXIMUM_WAIT_OBJECTS handles. If there are more
+   running processes, then we wait on them in groups, in short slices. */
+
+SEXP processx_wait_many(SEXP statuses, SEXP timeout, SEXP all) {
+  int i, n = LENGTH(statuses);
+  int ctimeout = INTEGER(timeout)[0], call = LOGICAL(all)[0];
+  double start = processx__now();
+  processx_handle_t **handles;
+  HANDLE *objects;
+  int *idx;
+  int next = 0;
+  SEXP result;
+
+  handles = (processx_handle_t**) R_alloc(n, sizeof(processx_handle_t*));
+  objects = (HANDLE*) R_alloc(MAXIMUM_WAIT_OBJECTS, sizeof(HANDLE));
+  idx = (int*) R_alloc(MAXIMUM_WAIT_OBJECTS, sizeof(int));
+  for (i = 0; i < n; i++) {
+    handles[i] = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+    if (!handles[i]) error("Internal processx error, handle already removed");
+  }
+
+  while (1) {
+    int done = 0, nobj = 0, k;
+    DWORD wait = PROCESSX_INTERRUPT_INTERVAL, res, exitcode;
+
+    for (i = 0; i < n; i++) done += handles[i]->collected;
+    if (call ? done == n : (done > 0 || n == 0)) break;
+
+    if (ctimeout >= 0) {
+      int timeleft = ctimeout - (processx__now() - start) * 1000;
+      if (timeleft <= 0) break;
+      if (timeleft < wait) wait = timeleft;
+    }
+
+    /* The next group of running processes, round robin */
+    for (k = 0; k < n && nobj < MAXIMUM_WAIT_OBJECTS; k++) {
+      i = (next + k) % n;
+      if (handles[i]->collected) continue;
+      objects[nobj] = handles[i]->hProcess;
+      idx[nobj++] = i;
+    }
+    next = (next + k) % n;
+    if (n - done > nobj && wait > 10) wait = 10;
+
+    res = WaitForMultipleObjects(nobj, objects, FALSE, wait);
+    processx__stats.poll_wakeups++;
+    if (res == WAIT_FAILED) {
+      PROCESSX_ERROR("wait on processes", GetLastError());
+    } else if (res == WAIT_TIMEOUT) {
+      R_CheckUserInterrupt();
+      continue;
+    }
+
+    /* Collect everything that has finished in this group */
+    for (k = 0; k < nobj; k++) {
+      processx_handle_t *handle = handles[idx[k]];
+      if (!GetExitCodeProcess(handle->hProcess, &exitcode)) {
+	PROCESSX_ERROR("get exit code after wait", GetLastError());
+      }
+      if (exitcode != STILL_ACTIVE) {
+	processx__collect_exit_status(VECTOR_ELT(statuses, idx[k]),
+				      exitcode);
+      }
+    }
+  }
+
+  result = PROTECT(allocVector(INTSXP, n));
+  for (i = 0; i < n; i++) {
+    INTEGER(result)[i] =
+      handles[i]->collected ? handles[i]->exitcode : NA_INTEGER;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Whether the process is running, if not, then we collect its exit
+   status. */
+
+static int processx__alive(SEXP status) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
   DWORD err, exitcode;
 
-  if (handle->collected) return ScalarLogical(0);
+  if (!handle) error("Internal processx error, handle already removed");
+  if (handle->collected) return 0;
 
   /* Otherwise try to get exit code */
   err = GetExitCodeProcess(handle->hProcess, &exitcode);
@@ -842,30 +928,63 @@ SEXP processx_is_alive(SEXP status) {
     PROCESSX_ERROR("get exit code to check if alive", GetLastError());
   }
 
-  if (exitcode == STILL_ACTIVE) {
-    return ScalarLogical(1);
-  } else {
-    processx__collect_exit_status(status, exitcode);
-    return ScalarLogical(0);
-  }
+  if (exitcode == STILL_ACTIVE) return 1;
+
+  processx__collect_exit_status(status, exitcode);
+  return 0;
+}
+
+SEXP processx_is_alive(SEXP status) {
+  return ScalarLogical(processx__alive(status));
 }
 
 SEXP processx_get_exit_status(SEXP status) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
-  DWORD err, exitcode;
+  if (processx__alive(status)) return R_NilValue;
+  return ScalarInteger(handle->exitcode);
+}
 
-  if (handle->collected) return ScalarInteger(handle->exitcode);
+/* Vectorized versions of the queries above */
 
-  /* Otherwise try to get exit code */
-  err = GetExitCodeProcess(handle->hProcess, &exitcode);
-  if (!err) {PROCESSX_ERROR("get exit status", GetLastError()); }
+SEXP processx_is_alive_many(SEXP statuses) {
+  int i, n = LENGTH(statuses);
+  SEXP result = PROTECT(allocVector(LGLSXP, n));
 
-  if (exitcode == STILL_ACTIVE) {
-    return R_NilValue;
-  } else {
-    processx__collect_exit_status(status, exitcode);
-    return ScalarInteger(handle->exitcode);
+  for (i = 0; i < n; i++) {
+    LOGICAL(result)[i] = processx__alive(VECTOR_ELT(statuses, i));
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_exit_status_many(SEXP statuses) {
+  int i, n = LENGTH(statuses);
+  SEXP result = PROTECT(allocVector(INTSXP, n));
+
+  for (i = 0; i < n; i++) {
+    SEXP status = VECTOR_ELT(statuses, i);
+    processx_handle_t *handle = R_ExternalPtrAddr(status);
+    INTEGER(result)[i] =
+      processx__alive(status) ? NA_INTEGER : handle->exitcode;
   }
+
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_pids_many(SEXP statuses) {
+  int i, n = LENGTH(statuses);
+  SEXP result = PROTECT(allocVector(INTSXP, n));
+
+  for (i = 0; i < n; i++) {
+    processx_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(statuses, i));
+    if (!handle) error("Internal processx error, handle already removed");
+    INTEGER(result)[i] = handle->dwProcessId;
+  }
+
+  UNPROTECT(1);
+  return result;
 }
 
 SEXP processx_signal(SEXP status, SEXP signal) {
@@ -926,6 +1045,21 @@ SEXP processx_kill(SEXP status, SEXP grace) {
   return processx_signal(status, ScalarInteger(9));
 }
 
+/* There is no SIGTERM on Windows, so the grace period is not used */
+
+SEXP processx_kill_many(SEXP statuses, SEXP grace) {
+  int i, n = LENGTH(statuses);
+  SEXP result = PROTECT(allocVector(LGLSXP, n));
+
+  for (i = 0; i < n; i++) {
+    LOGICAL(result)[i] =
+      LOGICAL(processx_kill(VECTOR_ELT(statuses, i), grace))[0];
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
 SEXP processx_get_pid(SEXP status) {
   processx_handle_t *handle = R_ExternalPtrAddr(status);
 
@@ -956,3 +1090,18 @@ SEXP processx__process_exists(SEXP pid) {
     return ScalarLogical(exitcode == STILL_ACTIVE);
   }
 }
+
+SEXP processx_get_resource_usage(SEXP status) {
+  error("Resource usage is not implemented on Windows yet");
+  return R_NilValue;
+}
+
+SEXP processx_file_connection(SEXP status, SEXP which, SEXP path,
+			      SEXP encoding) {
+  error("Reading output files is not implemented on Windows yet");
+  return R_NilValue;
+}
+
+SEXP processx_get_start_status(SEXP status) {
+  return mkString("started");
+}